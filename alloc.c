@@ -11,6 +11,12 @@ cbor_free(cbor_allocator *a, cbor *c)
 	if(c == nil)
 		return;
 
+	/* the whole tree is one block */
+	if(c->flags & CBOR_FLAG_FLAT){
+		a->free(a->context, c);
+		return;
+	}
+
 	switch(c->type){
 	default:
 		abort();
@@ -23,15 +29,22 @@ cbor_free(cbor_allocator *a, cbor *c)
 		break;
 
 	case CBOR_BYTE:
-		a->free(a->context, c->byte);
-		break;
-
 	case CBOR_STRING:
-		a->free(a->context, c->string);
+	case CBOR_RAW:
+		if(c->flags & CBOR_FLAG_INDEFINITE)
+			goto array;
+
+		if((c->flags & CBOR_FLAG_BORROWED) == 0)
+			a->free(a->context, c->byte);
 		break;
 
 	case CBOR_ARRAY:
 	case CBOR_MAP:
+		/* the children are still in the encoded input */
+		if(c->flags & CBOR_FLAG_LAZY)
+			break;
+
+	array:
 		for(i = 0; i < c->len; i++)
 			cbor_free(a, c->array[i]);
 		a->free(a->context, c->array);
@@ -91,6 +104,7 @@ cbor_make_uint(cbor_allocator *a, u64int v)
 		return nil;
 
 	c->type = CBOR_UINT;
+	c->flags = 0;
 	c->uint = v;
 
 	return c;
@@ -112,6 +126,7 @@ cbor_make_nint(cbor_allocator *a, s64int v)
 		return nil;
 
 	c->type = CBOR_NINT;
+	c->flags = 0;
 	c->uint = ui;
 
 	return c;
@@ -144,6 +159,7 @@ cbor_make_bytestring(cbor_allocator *a, uchar *buf, int n, int typ)
 
 	memmove(p, buf, n);
 	c->type = typ;
+	c->flags = 0;
 	c->len = n;
 	c->byte = p;
 
@@ -162,6 +178,40 @@ cbor_make_string(cbor_allocator *a, char *buf, int n)
 	return cbor_make_bytestring(a, (uchar*)buf, n, CBOR_STRING);
 }
 
+/*
+ * like cbor_make_bytestring, but buf is not copied. the node
+ * borrows it, so buf must outlive the node, and cbor_free
+ * leaves it alone.
+ */
+static cbor*
+cbor_make_bytestring_ref(cbor_allocator *a, uchar *buf, int n, int typ)
+{
+	cbor *c;
+
+	c = a->alloc(a->context, sizeof(*c));
+	if(c == nil)
+		return nil;
+
+	c->type = typ;
+	c->flags = CBOR_FLAG_BORROWED;
+	c->len = n;
+	c->byte = buf;
+
+	return c;
+}
+
+cbor*
+cbor_make_byte_ref(cbor_allocator *a, uchar *buf, int n)
+{
+	return cbor_make_bytestring_ref(a, buf, n, CBOR_BYTE);
+}
+
+cbor*
+cbor_make_string_ref(cbor_allocator *a, char *buf, int n)
+{
+	return cbor_make_bytestring_ref(a, (uchar*)buf, n, CBOR_STRING);
+}
+
 static cbor*
 cbor_make_arraymap(cbor_allocator *a, int len, int typ)
 {
@@ -178,6 +228,7 @@ cbor_make_arraymap(cbor_allocator *a, int len, int typ)
 	}
 
 	c->type = typ;
+	c->flags = 0;
 	c->len = len;
 
 	return c;
@@ -197,6 +248,9 @@ cbor_array_append(cbor_allocator *a, cbor *array, cbor *item)
 
 	assert(array->type == CBOR_ARRAY);
 
+	if(cbor_expand(a, array) < 0)
+		return nil;
+
 	osz = array->len * sizeof(cbor*);
 	nsz = (array->len + 1) * sizeof(cbor*);
 
@@ -206,6 +260,7 @@ cbor_array_append(cbor_allocator *a, cbor *array, cbor *item)
 
 	na[array->len] = item;
 
+	array->flags &= ~CBOR_FLAG_SIZED;
 	array->len += 1;
 	array->array = na;
 
@@ -228,6 +283,7 @@ cbor_make_map_element(cbor_allocator *a, cbor *k, cbor *v)
 		return nil;
 
 	c->type = CBOR_MAP_ELEMENT;
+	c->flags = 0;
 	c->key = k;
 	c->value = v;
 
@@ -243,6 +299,9 @@ cbor_map_append_element(cbor_allocator *a, cbor *map, cbor *elem)
 	assert(map->type == CBOR_MAP);
 	assert(elem->type == CBOR_MAP_ELEMENT);
 
+	if(cbor_expand(a, map) < 0)
+		return nil;
+
 	na = a->alloc(a->context, (map->len+1) * sizeof(cbor*));
 	if(na == nil)
 		return nil;
@@ -252,8 +311,10 @@ cbor_map_append_element(cbor_allocator *a, cbor *map, cbor *elem)
 
 	na[i] = elem;
 
+	/* an index went with the old array */
 	a->free(a->context, map->array);
 
+	map->flags &= ~(CBOR_FLAG_INDEXED|CBOR_FLAG_SIZED);
 	map->len += 1;
 	map->array = na;
 
@@ -289,6 +350,7 @@ cbor_make_tag(cbor_allocator *a, u64int tag, cbor *e)
 		return nil;
 
 	c->type = CBOR_TAG;
+	c->flags = 0;
 	c->tag = tag;
 	c->item = e;
 
@@ -305,6 +367,7 @@ cbor_make_null(cbor_allocator *a)
 		return nil;
 
 	c->type = CBOR_NULL;
+	c->flags = 0;
 
 	return c;
 }
@@ -319,6 +382,7 @@ cbor_make_float(cbor_allocator *a, float f)
 		return nil;
 
 	c->type = CBOR_FLOAT;
+	c->flags = 0;
 	c->f = f;
 
 	return c;
@@ -334,11 +398,53 @@ cbor_make_double(cbor_allocator *a, double d)
 		return nil;
 
 	c->type = CBOR_DOUBLE;
+	c->flags = 0;
 	c->d = d;
 
 	return c;
 }
 
+/* buf[0:n] must be one whole item */
+static int
+raw_check(uchar *buf, int n)
+{
+	uchar *p;
+
+	p = cbor_skip(buf, n, 1);
+	if(p == nil)
+		return -1;
+
+	if(p != buf + n){
+		werrstr("trailing bytes after raw item");
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * an item already encoded in buf[0:n], which encoders copy
+ * through as it is. buf must hold exactly one well-formed item.
+ */
+cbor*
+cbor_make_raw(cbor_allocator *a, uchar *buf, int n)
+{
+	if(raw_check(buf, n) < 0)
+		return nil;
+
+	return cbor_make_bytestring(a, buf, n, CBOR_RAW);
+}
+
+/* like cbor_make_raw, but buf is borrowed, not copied */
+cbor*
+cbor_make_raw_ref(cbor_allocator *a, uchar *buf, int n)
+{
+	if(raw_check(buf, n) < 0)
+		return nil;
+
+	return cbor_make_bytestring_ref(a, buf, n, CBOR_RAW);
+}
+
 int
 cbor_int(cbor *c, s64int *v)
 {
@@ -0,0 +1,477 @@
+#include <u.h>
+#include <libc.h>
+
+#include "cbor.h"
+
+/*
+ * decoding rate, in nodes per second, of the fast decoder and of
+ * the reference function table, over arrays of mostly small ints,
+ * and of records with and without their keys interned; and the
+ * encoding rate of two passes, sizing then writing, against one
+ * into a growable buffer.
+ * nodes come from an arena that is reset after each decode, so
+ * malloc does not drown out the decoder.
+ */
+
+enum {
+	NINT	= 4096,
+	NROW	= 16,
+	NREC	= 1024,
+	ARENA	= 1<<20,
+	ROUNDS	= 9,
+};
+
+typedef struct arena arena;
+struct arena {
+	uchar	*base, *p, *e;
+};
+
+static void*
+arena_alloc(void *context, ulong size)
+{
+	uchar *p;
+	arena *a;
+
+	a = context;
+	size = (size + 7) & ~7UL;
+	if(a->e - a->p < size)
+		return nil;
+
+	p = a->p;
+	a->p += size;
+	return p;
+}
+
+static void*
+arena_realloc(void *context, void *optr, ulong osize, ulong size)
+{
+	void *p;
+
+	p = arena_alloc(context, size);
+	if(p != nil && optr != nil)
+		memmove(p, optr, osize < size ? osize : size);
+	return p;
+}
+
+static void
+arena_free(void *context, void *ptr)
+{
+	USED(context, ptr);
+}
+
+static uchar*
+mkints(ulong *n)
+{
+	int i;
+	uchar *buf;
+	cbor *a, *c;
+
+	a = cbor_make_array(&cbor_default_allocator, NINT);
+	if(a == nil)
+		sysfatal("cbor_make_array: %r");
+
+	for(i = 0; i < NINT; i++){
+		switch(i % 8){
+		default:
+			c = cbor_make_uint(&cbor_default_allocator, i % 24);
+			break;
+		case 5:
+			c = cbor_make_uint(&cbor_default_allocator, 24 + i % 200);
+			break;
+		case 6:
+			c = cbor_make_uint(&cbor_default_allocator, 1000 + i);
+			break;
+		case 7:
+			c = cbor_make_int(&cbor_default_allocator, -1 - i % 24);
+			break;
+		}
+		if(c == nil)
+			sysfatal("cbor_make_uint: %r");
+		a->array[i] = c;
+	}
+
+	*n = cbor_encode_size(a);
+	buf = malloc(*n);
+	if(buf == nil)
+		sysfatal("malloc: %r");
+	if(cbor_encode(a, buf, *n) != *n)
+		sysfatal("cbor_encode: %r");
+
+	cbor_free(&cbor_default_allocator, a);
+
+	return buf;
+}
+
+/* the same ints, as rows of NROW */
+static uchar*
+mkrows(ulong *n)
+{
+	int i, j;
+	uchar *buf;
+	cbor *a, *r;
+
+	a = cbor_make_array(&cbor_default_allocator, NINT/NROW);
+	if(a == nil)
+		sysfatal("cbor_make_array: %r");
+
+	for(i = 0; i < NINT/NROW; i++){
+		r = cbor_make_array(&cbor_default_allocator, NROW);
+		if(r == nil)
+			sysfatal("cbor_make_array: %r");
+		for(j = 0; j < NROW; j++){
+			r->array[j] = cbor_make_uint(&cbor_default_allocator, (i + j) % 32);
+			if(r->array[j] == nil)
+				sysfatal("cbor_make_uint: %r");
+		}
+		a->array[i] = r;
+	}
+
+	*n = cbor_encode_size(a);
+	buf = malloc(*n);
+	if(buf == nil)
+		sysfatal("malloc: %r");
+	if(cbor_encode(a, buf, *n) != *n)
+		sysfatal("cbor_encode: %r");
+
+	cbor_free(&cbor_default_allocator, a);
+
+	return buf;
+}
+
+/* the best of ROUNDS rounds of iter decodes each, the engines taking turns */
+static void
+run(char *name, uchar *buf, ulong n, ulong nodes, int iter)
+{
+	int i, j, r;
+	uchar *mark;
+	vlong t0, t, best[2];
+	cbor_decoder *dec;
+	arena ar;
+	cbor_allocator alloc = {
+		.alloc		= arena_alloc,
+		.realloc	= arena_realloc,
+		.free		= arena_free,
+		.context	= &ar,
+	};
+	static int flags[] = { CBOR_DECODE_REFERENCE, 0 };
+	static char *engine[] = { "reference", "fast" };
+
+	ar.base = malloc(ARENA);
+	if(ar.base == nil)
+		sysfatal("malloc: %r");
+	ar.e = ar.base + ARENA;
+
+	best[0] = best[1] = 0;
+	for(r = 0; r < ROUNDS; r++)
+	for(j = 0; j < nelem(flags); j++){
+		/* the decoder sits at the bottom of the arena, below the trees */
+		ar.p = ar.base;
+		dec = cbor_decoder_new(&alloc, flags[j], nil);
+		if(dec == nil)
+			sysfatal("cbor_decoder_new: %r");
+		mark = ar.p;
+
+		t0 = nsec();
+		for(i = 0; i < iter; i++){
+			ar.p = mark;
+			if(cbor_decoder_decode(dec, buf, n) == nil)
+				sysfatal("cbor_decoder_decode: %r");
+		}
+		t = nsec() - t0;
+
+		if(best[j] == 0 || t < best[j])
+			best[j] = t;
+
+		cbor_decoder_free(dec);
+	}
+
+	for(j = 0; j < nelem(flags); j++)
+		print("%-6s %-10s %8.2f Mnodes/s\n", name, engine[j],
+			(double)nodes * iter / (best[j] > 0 ? best[j] : 1) * 1000.0);
+
+	free(ar.base);
+}
+
+/* records with the same three keys */
+static uchar*
+mkrecs(ulong *n)
+{
+	int i;
+	uchar *buf;
+	cbor *a, *r;
+	cbor_allocator *al;
+
+	al = &cbor_default_allocator;
+	a = cbor_make_array(al, NREC);
+	if(a == nil)
+		sysfatal("cbor_make_array: %r");
+
+	for(i = 0; i < NREC; i++){
+		r = cbor_make_map(al, 0);
+		if(r != nil)
+			r = cbor_map_append(al, r, cbor_make_string(al, "id", 2), cbor_make_uint(al, i));
+		if(r != nil)
+			r = cbor_map_append(al, r, cbor_make_string(al, "ts", 2), cbor_make_uint(al, 1000000+i));
+		if(r != nil)
+			r = cbor_map_append(al, r, cbor_make_string(al, "value", 5), cbor_make_uint(al, i % 7));
+		if(r == nil)
+			sysfatal("cbor_map_append: %r");
+		a->array[i] = r;
+	}
+
+	*n = cbor_encode_size(a);
+	buf = malloc(*n);
+	if(buf == nil)
+		sysfatal("malloc: %r");
+	if(cbor_encode(a, buf, *n) != *n)
+		sysfatal("cbor_encode: %r");
+
+	cbor_free(al, a);
+
+	return buf;
+}
+
+/* the records decoded with their keys copied, then interned */
+static void
+runintern(uchar *buf, ulong n, ulong nodes, int iter)
+{
+	int i, j, r;
+	uchar *mark;
+	ulong used[2];
+	vlong t0, t, best[2];
+	cbor_decoder *dec;
+	cbor_intern *tab;
+	arena ar;
+	cbor_allocator alloc = {
+		.alloc		= arena_alloc,
+		.realloc	= arena_realloc,
+		.free		= arena_free,
+		.context	= &ar,
+	};
+	static char *how[] = { "copied", "interned" };
+
+	ar.base = malloc(ARENA);
+	if(ar.base == nil)
+		sysfatal("malloc: %r");
+	ar.e = ar.base + ARENA;
+
+	tab = cbor_intern_new(&cbor_default_allocator, 16, 0);
+	if(tab == nil)
+		sysfatal("cbor_intern_new: %r");
+
+	best[0] = best[1] = 0;
+	for(r = 0; r < ROUNDS; r++)
+	for(j = 0; j < 2; j++){
+		ar.p = ar.base;
+		dec = cbor_decoder_new(&alloc, 0, nil);
+		if(dec == nil)
+			sysfatal("cbor_decoder_new: %r");
+		if(j == 1)
+			cbor_decoder_intern(dec, tab);
+		mark = ar.p;
+
+		t0 = nsec();
+		for(i = 0; i < iter; i++){
+			ar.p = mark;
+			if(cbor_decoder_decode(dec, buf, n) == nil)
+				sysfatal("cbor_decoder_decode: %r");
+		}
+		t = nsec() - t0;
+
+		used[j] = ar.p - mark;
+		if(best[j] == 0 || t < best[j])
+			best[j] = t;
+
+		cbor_decoder_free(dec);
+	}
+
+	for(j = 0; j < 2; j++)
+		print("%-6s %-10s %8.2f Mnodes/s %8lud bytes\n", "recs", how[j],
+			(double)nodes * iter / (best[j] > 0 ? best[j] : 1) * 1000.0, used[j]);
+
+	cbor_intern_free(tab);
+	free(ar.base);
+}
+
+/* encode the item in buf back into storage of the same size */
+static void
+runenc(char *name, uchar *buf, ulong n, int iter)
+{
+	int i, j, r;
+	ulong len;
+	uchar *out;
+	vlong t0, t, best[2];
+	cbor *c;
+	static char *how[] = { "two-pass", "one-pass" };
+
+	c = cbor_decode(&cbor_default_allocator, buf, n);
+	if(c == nil)
+		sysfatal("cbor_decode: %r");
+
+	out = malloc(n);
+	if(out == nil)
+		sysfatal("malloc: %r");
+
+	best[0] = best[1] = 0;
+	for(r = 0; r < ROUNDS; r++)
+	for(j = 0; j < 2; j++){
+		t0 = nsec();
+		for(i = 0; i < iter; i++){
+			if(j == 0){
+				len = cbor_encode_size(c);
+				if(len > n || cbor_encode(c, out, len) != len)
+					sysfatal("cbor_encode: %r");
+			} else {
+				if(cbor_encode_alloc(&cbor_default_allocator, c, out, n, &len) != out)
+					sysfatal("cbor_encode_alloc: %r");
+			}
+		}
+		t = nsec() - t0;
+
+		if(best[j] == 0 || t < best[j])
+			best[j] = t;
+	}
+
+	for(j = 0; j < 2; j++)
+		print("%-6s %-10s %8.2f MB/s\n", name, how[j],
+			(double)n * iter / (best[j] > 0 ? best[j] : 1) * 1000.0);
+
+	free(out);
+	cbor_free(&cbor_default_allocator, c);
+}
+
+/* resize a tree after appending to one row */
+static void
+runsize(char *name, uchar *buf, ulong n, int iter)
+{
+	int i, j, r;
+	ulong len;
+	vlong t0, t, best[2];
+	cbor *c, *row;
+	static char *how[] = { "uncached", "cached" };
+
+	c = cbor_decode(&cbor_default_allocator, buf, n);
+	if(c == nil || c->type != CBOR_ARRAY || c->len == 0)
+		sysfatal("cbor_decode: %r");
+
+	best[0] = best[1] = 0;
+	for(r = 0; r < ROUNDS; r++)
+	for(j = 0; j < 2; j++){
+		t0 = nsec();
+		for(i = 0; i < iter; i++){
+			row = c->array[i % c->len];
+			if(cbor_array_append(&cbor_default_allocator, row, cbor_make_uint(&cbor_default_allocator, i)) == nil)
+				sysfatal("cbor_array_append: %r");
+			if(j == 0)
+				len = cbor_encode_size(c);
+			else {
+				cbor_touch(c);
+				len = cbor_encode_size_cached(c);
+			}
+			if(len == 0)
+				sysfatal("cbor_encode_size: %r");
+		}
+		t = nsec() - t0;
+
+		if(best[j] == 0 || t < best[j])
+			best[j] = t;
+	}
+
+	for(j = 0; j < 2; j++)
+		print("%-6s %-10s %8.2f Ksizes/s\n", name, how[j],
+			(double)iter / (best[j] > 0 ? best[j] : 1) * 1e6);
+
+	cbor_free(&cbor_default_allocator, c);
+}
+
+/* encode a tree whose rows are kept encoded, against one decoded whole */
+static void
+runraw(char *name, uchar *buf, ulong n, int iter)
+{
+	int i, j, r;
+	uchar *out;
+	vlong t0, t, best[2];
+	cbor *c[2];
+	cbor_decoder *dec;
+	static char *how[] = { "tree", "raw" };
+
+	dec = cbor_decoder_new(&cbor_default_allocator, 0, nil);
+	if(dec == nil)
+		sysfatal("cbor_decoder_new: %r");
+
+	c[0] = cbor_decoder_decode(dec, buf, n);
+	cbor_decoder_raw(dec, 1);
+	c[1] = cbor_decoder_decode(dec, buf, n);
+	if(c[0] == nil || c[1] == nil)
+		sysfatal("cbor_decoder_decode: %r");
+
+	out = malloc(n);
+	if(out == nil)
+		sysfatal("malloc: %r");
+
+	best[0] = best[1] = 0;
+	for(r = 0; r < ROUNDS; r++)
+	for(j = 0; j < 2; j++){
+		t0 = nsec();
+		for(i = 0; i < iter; i++)
+			if(cbor_encode(c[j], out, n) != n)
+				sysfatal("cbor_encode: %r");
+		t = nsec() - t0;
+
+		if(best[j] == 0 || t < best[j])
+			best[j] = t;
+	}
+
+	for(j = 0; j < 2; j++)
+		print("%-6s %-10s %8.2f MB/s\n", name, how[j],
+			(double)n * iter / (best[j] > 0 ? best[j] : 1) * 1000.0);
+
+	free(out);
+	cbor_free(&cbor_default_allocator, c[0]);
+	cbor_free(&cbor_default_allocator, c[1]);
+	cbor_decoder_free(dec);
+}
+
+static void
+usage(void)
+{
+	fprint(2, "usage: %s [-n iterations]\n", argv0);
+	exits("usage");
+}
+
+void
+main(int argc, char *argv[])
+{
+	int iter;
+	ulong n;
+	uchar *buf;
+
+	iter = 500;
+
+	ARGBEGIN{
+	case 'n':
+		iter = atoi(EARGF(usage()));
+		break;
+	default:
+		usage();
+	}ARGEND
+
+	buf = mkints(&n);
+	run("ints", buf, n, 1 + NINT, iter);
+	free(buf);
+
+	buf = mkrows(&n);
+	run("rows", buf, n, 1 + NINT/NROW + NINT, iter);
+	runenc("rows", buf, n, iter);
+	runsize("rows", buf, n, iter);
+	runraw("rows", buf, n, iter);
+	free(buf);
+
+	/* a map has a node for each element, key and value */
+	buf = mkrecs(&n);
+	runintern(buf, n, 1 + NREC * (1 + 3*3), iter);
+	runenc("recs", buf, n, iter);
+	free(buf);
+
+	exits(nil);
+}
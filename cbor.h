@@ -12,18 +12,45 @@ enum {
 	CBOR_NULL,
 	CBOR_FLOAT,
 	CBOR_DOUBLE,
+	CBOR_RAW,	/* an item still encoded, in byte[0:len] */
 
 	CBOR_TYPE_MAX,
 
 	CBOR_TAG_DATETIME	= 0,
 	CBOR_TAG_UNIXTIME	= 1,
+	CBOR_TAG_BIGNUM		= 2,
+	CBOR_TAG_NEGBIGNUM	= 3,
+	CBOR_TAG_DECIMAL	= 4,
 	CBOR_TAG_CBOR		= 55799ULL,
+
+	/* cbor.flags */
+	CBOR_FLAG_BORROWED	= 1<<0,	/* byte/string/raw points into the decode buffer */
+	CBOR_FLAG_INDEFINITE	= 1<<1,	/* indefinite length; byte/string holds chunks in array */
+	CBOR_FLAG_FLAT		= 1<<2,	/* root of a cbor_decode_flat tree */
+	CBOR_FLAG_LAZY		= 1<<3,	/* array/map not decoded yet; see cbor_expand */
+	CBOR_FLAG_INTERNED	= 1<<4,	/* string is shared from a cbor_intern table */
+	CBOR_FLAG_INDEXED	= 1<<5,	/* map has a key index after its elements; see cbor_map_index */
+	CBOR_FLAG_SIZED		= 1<<6,	/* array/map esize is its encoded size; see cbor_encode_size_cached */
+
+	/* cbor_decode flags */
+	CBOR_DECODE_BORROW	= 1<<0,
+	CBOR_DECODE_COALESCE	= 1<<1,	/* join indefinite-length string chunks */
+	CBOR_DECODE_REFERENCE	= 1<<2,	/* use the original per-byte function table */
+	CBOR_DECODE_INDEX	= 1<<3,	/* index maps of CBOR_INDEXMIN elements or more */
+
+	/* default limit on nested arrays, maps and tags */
+	CBOR_MAXDEPTH		= 1024,
+
+	/* smallest map CBOR_DECODE_INDEX indexes */
+	CBOR_INDEXMIN		= 16,
 };
 
 typedef struct cbor cbor;
 struct cbor
 {
 	uchar	type;
+	uchar	flags;
+	u32int	esize;	/* with CBOR_FLAG_SIZED */
 
 	union {
 		/* CBOR_UINT */
@@ -34,7 +61,7 @@ struct cbor
 			int len;
 
 			union {
-				/* CBOR_BYTE */
+				/* CBOR_BYTE, CBOR_RAW */
 				uchar*	byte;
 
 				/* CBOR_STRING */
@@ -57,6 +84,12 @@ struct cbor
 			cbor*	item;
 		};
 
+		/* CBOR_ARRAY / CBOR_MAP with CBOR_FLAG_LAZY */
+		struct {
+			uchar*	enc;	/* the encoded item, header first */
+			uchar*	ence;	/* end of the input it is in */
+		};
+
 		/* CBOR_FLOAT */
 		float	f;
 
@@ -80,23 +113,197 @@ cbor*	cbor_make_nint(cbor_allocator *a, s64int v);
 cbor*	cbor_make_int(cbor_allocator *a, s64int v);
 cbor*	cbor_make_byte(cbor_allocator *a, uchar *buf, int n);
 cbor*	cbor_make_string(cbor_allocator *a, char *buf, int n);
+cbor*	cbor_make_byte_ref(cbor_allocator *a, uchar *buf, int n);
+cbor*	cbor_make_string_ref(cbor_allocator *a, char *buf, int n);
 cbor*	cbor_make_array(cbor_allocator *a, int len);
 cbor*	cbor_array_append(cbor_allocator *a, cbor *array, cbor *item);
 cbor*	cbor_make_map(cbor_allocator *a, int len);
 cbor*	cbor_make_map_element(cbor_allocator *a, cbor *k, cbor *v);
 cbor*	cbor_map_append_element(cbor_allocator *a, cbor *map, cbor *elem);
 cbor*	cbor_map_append(cbor_allocator *a, cbor *map, cbor *key, cbor *value);
+int	cbor_map_index(cbor_allocator *a, cbor *map);
+cbor*	cbor_map_get(cbor *map, char *key, int n);
 cbor*	cbor_make_tag(cbor_allocator *a, u64int tag, cbor *e);
 cbor*	cbor_make_null(cbor_allocator *a);
 cbor*	cbor_make_float(cbor_allocator *a, float f);
 cbor*	cbor_make_double(cbor_allocator *a, double d);
+cbor*	cbor_make_raw(cbor_allocator *a, uchar *buf, int n);
+cbor*	cbor_make_raw_ref(cbor_allocator *a, uchar *buf, int n);
 
 int		cbor_int(cbor *c, s64int *v);
 
 void	cbor_free(cbor_allocator *a, cbor *c);
 cbor*	cbor_decode(cbor_allocator *alloc, uchar *buf, ulong n);
+cbor*	cbor_decode_borrow(cbor_allocator *alloc, uchar *buf, ulong n);
+cbor*	cbor_decode_seq(cbor_allocator *alloc, uchar *buf, ulong n, ulong *used);
+cbor*	cbor_decode_lazy(cbor_allocator *alloc, uchar *buf, ulong n);
+int	cbor_expand(cbor_allocator *alloc, cbor *c);
+cbor*	cbor_index(cbor_allocator *alloc, cbor *c, int i);
+
+typedef struct cbor_decoder cbor_decoder;
+typedef struct cbor_intern cbor_intern;
+typedef struct cbor_scaninfo cbor_scaninfo;
+typedef struct cbor_limits cbor_limits;
+
+/* limits on what decoding one item may take; 0 is no limit */
+struct cbor_limits {
+	int	maxdepth;	/* nesting of arrays, maps and tags; 0 is CBOR_MAXDEPTH */
+	ulong	maxlen;	/* elements of an array or map, chunks of a string */
+	ulong	maxstring;	/* bytes of a byte or text string */
+	ulong	maxalloc;	/* bytes allocated, the work stack included */
+};
+
+struct cbor_scaninfo {
+	ulong	len;	/* encoded length of the item */
+	ulong	nodes;	/* cbor nodes it decodes to, map elements included */
+	ulong	bytes;	/* byte and text string contents */
+	int	depth;	/* deepest nesting of arrays, maps and tags */
+	ulong	size;	/* bytes cbor_decode_flat allocates for it */
+};
+
+int	cbor_scan(cbor_allocator *alloc, uchar *buf, ulong n, cbor_scaninfo *si);
+cbor*	cbor_decode_flat(cbor_allocator *alloc, uchar *buf, ulong n);
+cbor*	cbor_decode_limits(cbor_allocator *alloc, uchar *buf, ulong n, cbor_limits *lim);
+
+cbor_decoder*	cbor_decoder_new(cbor_allocator *alloc, int flags, cbor_limits *lim);
+void	cbor_decoder_free(cbor_decoder *dec);
+cbor*	cbor_decoder_decode(cbor_decoder *dec, uchar *buf, ulong n);
+long	cbor_decoder_feed(cbor_decoder *dec, uchar *buf, ulong n, cbor **rc);
+int	cbor_decoder_hook(cbor_decoder *dec, u64int tag,
+	cbor *(*fn)(cbor_allocator *alloc, u64int tag, cbor *item, void *arg), void *arg);
+void	cbor_decoder_intern(cbor_decoder *dec, cbor_intern *tab);
+void	cbor_decoder_raw(cbor_decoder *dec, int depth);
+
+cbor_intern*	cbor_intern_new(cbor_allocator *alloc, int maxlen, ulong max);
+void	cbor_intern_free(cbor_intern *tab);
+char*	cbor_intern_str(cbor_intern *tab, char *s, int n);
+
+/* tag hooks for cbor_decoder_hook */
+cbor*	cbor_hook_unixtime(cbor_allocator *alloc, u64int tag, cbor *item, void *arg);
+cbor*	cbor_hook_bignum(cbor_allocator *alloc, u64int tag, cbor *item, void *arg);
+cbor*	cbor_hook_decimal(cbor_allocator *alloc, u64int tag, cbor *item, void *arg);
+
 ulong	cbor_encode(cbor *c, uchar *buf, ulong n);
 ulong	cbor_encode_size(cbor *c);
+ulong	cbor_encode_size_cached(cbor *c);
+void	cbor_touch(cbor *c);
+uchar*	cbor_encode_canonical(cbor_allocator *alloc, cbor *c, uchar *buf, ulong n, ulong *len);
+uchar*	cbor_encode_preferred(cbor_allocator *alloc, cbor *c, uchar *buf, ulong n, ulong *len);
+uchar*	cbor_encode_alloc(cbor_allocator *alloc, cbor *c, uchar *buf, ulong n, ulong *len);
+ulong	cbor_encode_indefinite(int type, uchar *buf, ulong n);
+ulong	cbor_encode_break(uchar *buf, ulong n);
+
+/* a piece of output from cbor_encode_segs */
+typedef struct cbor_seg cbor_seg;
+struct cbor_seg {
+	uchar	*p;
+	ulong	n;
+};
+
+int	cbor_encode_segs(cbor *c, uchar *buf, ulong n, cbor_seg *seg, int nseg, ulong min);
+
+/* writes items straight out, without a tree; see write.c */
+typedef struct cbor_writer cbor_writer;
+struct cbor_writer {
+	uchar	*s, *p, *e;	/* buffer, next byte, end */
+	long	(*flush)(void *arg, uchar *buf, long n);
+	void	*arg;
+	uvlong	n;	/* bytes put, including those that did not fit */
+	int	err;	/* a put or flush has failed */
+};
+
+void	cbor_writer_init(cbor_writer *w, uchar *buf, ulong n, long (*flush)(void*, uchar*, long), void *arg);
+void	cbor_writer_fd(cbor_writer *w, int fd, uchar *buf, ulong n);
+int	cbor_writer_flush(cbor_writer *w);
+int	cbor_put_uint(cbor_writer *w, u64int v);
+int	cbor_put_int(cbor_writer *w, s64int v);
+int	cbor_put_byte(cbor_writer *w, uchar *buf, ulong n);
+int	cbor_put_string(cbor_writer *w, char *s, ulong n);
+int	cbor_put_null(cbor_writer *w);
+int	cbor_put_float(cbor_writer *w, float f);
+int	cbor_put_double(cbor_writer *w, double d);
+int	cbor_put_real(cbor_writer *w, double d);
+int	cbor_put_tag(cbor_writer *w, u64int tag);
+int	cbor_begin_array(cbor_writer *w, vlong n);
+int	cbor_begin_map(cbor_writer *w, vlong n);
+int	cbor_end(cbor_writer *w);
+vlong	cbor_put_uint_fixed(cbor_writer *w, u64int v);
+vlong	cbor_put_int_fixed(cbor_writer *w, s64int v);
+vlong	cbor_put_double_fixed(cbor_writer *w, double d);
+int	cbor_patch_uint(uchar *buf, ulong n, vlong off, u64int v);
+int	cbor_patch_int(uchar *buf, ulong n, vlong off, s64int v);
+int	cbor_patch_double(uchar *buf, ulong n, vlong off, double d);
+
+typedef struct cbor_cursor cbor_cursor;
+struct cbor_cursor {
+	uchar	*p, *e;	/* input not yet read */
+	u64int	left;	/* items left at this level */
+	u64int	skip;	/* children of the current item not yet read */
+
+	/* the current item */
+	uchar	*item;	/* its encoding, header first */
+	int	type;
+	int	flags;	/* CBOR_FLAG_INDEFINITE: no len; enter to read it */
+	u64int	uint;	/* CBOR_UINT, CBOR_NINT as in cbor; CBOR_TAG number */
+	u64int	len;	/* CBOR_BYTE, CBOR_STRING bytes; CBOR_ARRAY, CBOR_MAP elements */
+	uchar	*byte;	/* CBOR_BYTE, CBOR_STRING contents, in the input */
+	float	f;
+	double	d;
+};
+
+uchar*	cbor_skip(uchar *buf, ulong n, ulong count);
+long	cbor_item_len(uchar *buf, ulong n);
+
+/* an item in a sequence */
+typedef struct cbor_span cbor_span;
+struct cbor_span {
+	ulong	off;
+	ulong	len;
+};
+
+long	cbor_seq_split(uchar *buf, ulong n, cbor_span *span, long nspan);
+long	cbor_decode_procs(cbor_allocator *alloc, int nproc, uchar *buf, ulong n,
+	cbor_span *span, cbor **item, int *who, long nitem);
+
+void	cbor_cursor_init(cbor_cursor *cur, uchar *buf, ulong n);
+int	cbor_next(cbor_cursor *cur);
+int	cbor_enter(cbor_cursor *cur, cbor_cursor *sub);
+int	cbor_leave(cbor_cursor *cur, cbor_cursor *sub);
+int	cbor_query(uchar *buf, ulong n, char *path, cbor_cursor *cur);
+
+/*
+ * a field of a C struct and the item it is decoded from. the
+ * fields of an array are its elements in order; those of a map
+ * are found by key.
+ */
+typedef struct cbor_field cbor_field;
+struct cbor_field {
+	char	*key;	/* map key; nil in an array */
+	int	type;	/* of the item; CBOR_NINT for any integer, signed */
+	int	flags;
+	ulong	off;	/* of the field in the struct */
+	int	size;	/* of the field, or of each element with CBOR_FIELD_REPEAT */
+
+	/* CBOR_BYTE: the length; CBOR_FIELD_REPEAT: the element count */
+	ulong	lenoff;
+	int	lensize;
+
+	int	max;	/* CBOR_FIELD_REPEAT: elements the field holds */
+
+	/* CBOR_ARRAY, CBOR_MAP: the nested fields; CBOR_TAG: the tagged item */
+	cbor_field	*sub;
+	int	nsub;
+};
+
+enum {
+	/* cbor_field.flags */
+	CBOR_FIELD_REPEAT	= 1<<0,	/* an array of items into an array of fields */
+};
+
+#define CBOR_OFF(t, m)	((ulong)&((t*)0)->m)
+
+int	cbor_next_struct(cbor_cursor *cur, cbor_field *f, void *v);
+long	cbor_decode_struct(uchar *buf, ulong n, cbor_field *f, void *v);
 
 cbor*	cbor_pack(cbor_allocator *a, char *fmt, ...);
 int		cbor_unpack(cbor_allocator *a, cbor *c, char *fmt, ...);
@@ -1,9 +1,104 @@
+typedef struct cbor_frame cbor_frame;
 typedef struct cbor_coder cbor_coder;
+typedef struct cbor_hdr cbor_hdr;
+typedef struct cbor_taghook cbor_taghook;
+
+enum {
+	CBOR_NSTACK	= 16,	/* frames held before the stack moves to the heap */
+
+	/* cbor_coder.flags when encoding */
+	CBOR_ENC_CANON	= 1<<0,	/* deterministic: definite lengths, sorted keys */
+	CBOR_ENC_SHORT	= 1<<1,	/* floats in the shortest form that holds them */
+	CBOR_ENC_CACHE	= 1<<2,	/* sizing: use and keep sizes in arrays and maps */
+};
+
+/* cbor_frame.n of an indefinite-length item */
+#define INDEF	(~0ULL)
+
+/* an open array, map or tag in the decoder */
+struct cbor_frame {
+	cbor	*c;
+	u64int	i;	/* next slot to fill */
+	u64int	n;	/* slots in c; maps have two per element */
+	cbor	*k;	/* map key waiting for its value */
+	int	major;	/* cbor_scan: major type of the open item */
+	cbor_taghook	*hook;	/* a hooked tag: c is nil and k its item */
+};
+
+/* a decoder's hook for a tag number */
+struct cbor_taghook {
+	u64int	tag;
+	cbor	*(*fn)(cbor_allocator*, u64int, cbor*, void*);
+	void	*arg;
+};
+
 struct cbor_coder {
 	cbor_allocator *alloc;
+	int flags;
 	uchar *s, *e, *p;
+
+	/* decoder work stack; stk0 is the caller's initial storage */
+	cbor_frame *stk, *stk0;
+	int sp, nstk, maxdepth;
+
+	/* incremental decoding */
+	int partial;	/* suspend at the end of input instead of failing */
+	int more;	/* suspended, waiting for input */
+	cbor *str;	/* byte or text string still being filled */
+	u64int nstr;	/* bytes of str filled; str->len is what is allocated */
+	u64int lstr;	/* bytes str will have */
+
+	/* limits; with lim.maxalloc, alloc counts into nalloc and passes on to real */
+	cbor_limits lim;
+	cbor_allocator counted, *real;
+	uvlong nalloc;
+
+	/* tags decoded by hooks instead of into CBOR_TAG nodes */
+	cbor_taghook *hooks;
+	int nhooks;
+
+	/* map keys shared from here instead of copied */
+	cbor_intern *intern;
+
+	/* arrays and maps opened at depth rawdepth-1 are kept as CBOR_RAW */
+	int rawdepth;
+
+	/* encoding: the output grows from alloc; own once s is allocated */
+	int grow, own;
+
+	/* encoding to segments: strings of segmin bytes or more are referenced */
+	cbor_seg *seg;
+	int nseg, maxseg;
+	ulong segmin;
+	uchar *mark;	/* start of output not yet in a segment */
+};
+
+/* an item's initial byte and argument */
+struct cbor_hdr {
+	uchar	op;
+	uchar	major;	/* op>>5 */
+	u64int	arg;	/* value, length, tag, or float bits */
+};
+
+struct cbor_decoder {
+	cbor_coder	d;
+	cbor_frame	stk[CBOR_NSTACK];
+
+	/* a header split across chunks */
+	uchar	hold[9];
+	int	nhold;
 };
 
 
 uchar* cbor_take(cbor_coder *d, long want);
+int	cbor_grow(cbor_coder *d, long want);
+uchar*	cbor_head(uchar *p, uchar *e, cbor_hdr *h);
+double	cbor_half(u16int v);
+uchar*	cbor_skipn(uchar *p, uchar *e, u64int n);
+u32int	cbor_hash(char *s, int n);
+int	cbor_headlen(u64int v);
+int	cbor_puthead(uchar *p, uchar major, u64int v);
+int	cbor_putheadn(uchar *p, uchar major, u64int v, int n);
+int	cbor_floatlen(double v);
+int	cbor_putfloat(uchar *p, double v);
 //#define cbor_take(d, want) ((d->e - d->p < want) ? nil : (d->p += want, d->p - want))
@@ -14,8 +14,8 @@ cbor_print(cbor *c, char *bp, char *be)
 	case CBOR_UINT:
 		return seprint(bp, be, "%llud", c->uint);
 
-	case CBOR_SINT:
-		return seprint(bp, be, "%lld", c->sint);
+	case CBOR_NINT:
+		return seprint(bp, be, "-%llud", c->uint+1);
 
 	case CBOR_BYTE:
 		return seprint(bp, be, "%.*H", c->len, c->byte);
@@ -89,209 +89,253 @@ cbor_fprint(int fd, cbor *c)
 	fprint(fd, "%s\n", buf);
 }
 
+static void
+putqid(cbor_writer *w, Qid *q)
+{
+	cbor_begin_array(w, 3);
+	cbor_put_uint(w, q->type);
+	cbor_put_uint(w, q->vers);
+	cbor_put_uint(w, q->path);
+}
+
+/* written straight into ap; a message that does not fit is only measured */
 ulong
 convS2Mcbor(Fcall *f, uchar *ap, uint nap)
 {
-	int i, n, nn;
-	ulong sz;
-	cbor *o, *c, *a;
+	int i;
+	cbor_writer w;
+
+	cbor_writer_init(&w, ap, nap, nil, nil);
+
+	cbor_put_tag(&w, f->type);
+	cbor_begin_array(&w, 2);
+	cbor_put_uint(&w, f->tag);
 
 	switch(f->type){
 	default:
 		abort();
 
 	case Tversion:
-		n = strlen(f->version);
-		o = cbor_pack(&cbor_default_allocator, "[us]", (u64int)f->msize, n, f->version);
+	case Rversion:
+		cbor_begin_array(&w, 2);
+		cbor_put_uint(&w, f->msize);
+		cbor_put_string(&w, f->version, strlen(f->version));
 		break;
 
 	case Tflush:
-		o = cbor_pack(&cbor_default_allocator, "u", (u64int)f->oldtag);
+		cbor_put_uint(&w, f->oldtag);
 		break;
 
 	case Tauth:
-		n = strlen(f->uname);
-		nn = strlen(f->aname);
-		o = cbor_pack(&cbor_default_allocator, "[uss]", (u64int)f->afid, n, f->uname, nn, f->aname);
+		cbor_begin_array(&w, 3);
+		cbor_put_uint(&w, f->afid);
+		cbor_put_string(&w, f->uname, strlen(f->uname));
+		cbor_put_string(&w, f->aname, strlen(f->aname));
 		break;
 
 	case Tattach:
-		n = strlen(f->uname);
-		nn = strlen(f->aname);
-		o = cbor_pack(&cbor_default_allocator, "[uuss]", (u64int)f->fid, (u64int)f->afid, n, f->uname, nn, f->aname);
+		cbor_begin_array(&w, 4);
+		cbor_put_uint(&w, f->fid);
+		cbor_put_uint(&w, f->afid);
+		cbor_put_string(&w, f->uname, strlen(f->uname));
+		cbor_put_string(&w, f->aname, strlen(f->aname));
 		break;
 
 	case Twalk:
-		a = cbor_make_array(&cbor_default_allocator, 0);
-		assert(a != nil);
-		for(i = 0; i < f->nwname; i++){
-			o = cbor_make_string(&cbor_default_allocator, f->wname[i], strlen(f->wname[i]));
-			assert(o != nil);
-			assert(cbor_array_append(&cbor_default_allocator, a, o) != nil);
-		}
-
-		o = cbor_pack(&cbor_default_allocator, "[uuc]", (u64int)f->fid, (u64int)f->newfid, a);
+		cbor_begin_array(&w, 3);
+		cbor_put_uint(&w, f->fid);
+		cbor_put_uint(&w, f->newfid);
+		cbor_begin_array(&w, f->nwname);
+		for(i = 0; i < f->nwname; i++)
+			cbor_put_string(&w, f->wname[i], strlen(f->wname[i]));
 		break;
 
 	case Topen:
-		o = cbor_pack(&cbor_default_allocator, "[uu]", (u64int)f->fid, f->mode);
+		cbor_begin_array(&w, 2);
+		cbor_put_uint(&w, f->fid);
+		cbor_put_uint(&w, f->mode);
 		break;
 
 	case Tcreate:
-		n = strlen(f->name);
-		o = cbor_pack(&cbor_default_allocator, "[usuu]", (u64int)f->fid, n, f->name, f->perm, f->mode);
+		cbor_begin_array(&w, 4);
+		cbor_put_uint(&w, f->fid);
+		cbor_put_string(&w, f->name, strlen(f->name));
+		cbor_put_uint(&w, f->perm);
+		cbor_put_uint(&w, f->mode);
 		break;
 
 	case Tread:
-		o = cbor_pack(&cbor_default_allocator, "[uiu]", (u64int)f->fid, (s64int)f->offset, f->count);
+		cbor_begin_array(&w, 3);
+		cbor_put_uint(&w, f->fid);
+		cbor_put_int(&w, f->offset);
+		cbor_put_uint(&w, f->count);
 		break;
 
 	case Twrite:
-		o = cbor_pack(&cbor_default_allocator, "[uib]", (u64int)f->fid, (s64int)f->offset, f->count, f->data);
+		cbor_begin_array(&w, 3);
+		cbor_put_uint(&w, f->fid);
+		cbor_put_int(&w, f->offset);
+		cbor_put_byte(&w, (uchar*)f->data, f->count);
 		break;
 
 	case Tclunk:
 	case Tremove:
 	case Tstat:
-		o = cbor_pack(&cbor_default_allocator, "u", (u64int)f->fid);
+		cbor_put_uint(&w, f->fid);
 		break;
 
 	case Twstat:
-		o = cbor_pack(&cbor_default_allocator, "[ub]", (u64int)f->fid, f->nstat, f->stat);
-		break;
-
-	case Rversion:
-		n = strlen(f->version);
-		o = cbor_pack(&cbor_default_allocator, "[us]", (u64int)f->msize, n, f->version);
+		cbor_begin_array(&w, 2);
+		cbor_put_uint(&w, f->fid);
+		cbor_put_byte(&w, f->stat, f->nstat);
 		break;
 
 	case Rerror:
-		n = strlen(f->ename);
-		o = cbor_pack(&cbor_default_allocator, "s", n, f->ename);
+		cbor_put_string(&w, f->ename, strlen(f->ename));
 		break;
 
 	case Rflush:
-		o = cbor_pack(&cbor_default_allocator, "N");
+	case Rclunk:
+	case Rremove:
+	case Rwstat:
+		cbor_put_null(&w);
 		break;
 
 	case Rauth:
-		o = cbor_pack(&cbor_default_allocator, "[uuu]",
-			(u64int)f->aqid.type, (u64int)f->aqid.vers, (u64int)f->aqid.path);
+		putqid(&w, &f->aqid);
 		break;
 
 	case Rattach:
-		o = cbor_pack(&cbor_default_allocator, "[uuu]",
-			(u64int)f->qid.type, (u64int)f->qid.vers, (u64int)f->qid.path);
+		putqid(&w, &f->qid);
 		break;
 
 	case Rwalk:
-		a = cbor_make_array(&cbor_default_allocator, 0);
-		assert(a != nil);
-		for(i = 0; i < f->nwqid; i++){
-			o = cbor_pack(&cbor_default_allocator, "[uuu]",
-				(u64int)f->wqid[i].type, (u64int)f->wqid[i].vers, (u64int)f->wqid[i].path);
-			assert(o != nil);
-			assert(cbor_array_append(&cbor_default_allocator, a, o) != nil);
-		}
-
-		o = a;
-
+		cbor_begin_array(&w, f->nwqid);
+		for(i = 0; i < f->nwqid; i++)
+			putqid(&w, &f->wqid[i]);
 		break;
 
 	case Ropen:
 	case Rcreate:
-		o = cbor_pack(&cbor_default_allocator, "[uuuu]",
-			(u64int)f->qid.type, (u64int)f->qid.vers, (u64int)f->qid.path, (u64int)f->iounit);
+		cbor_begin_array(&w, 4);
+		cbor_put_uint(&w, f->qid.type);
+		cbor_put_uint(&w, f->qid.vers);
+		cbor_put_uint(&w, f->qid.path);
+		cbor_put_uint(&w, f->iounit);
 		break;
 
 	case Rread:
-		o = cbor_pack(&cbor_default_allocator, "b", f->count, f->data);
+		cbor_put_byte(&w, (uchar*)f->data, f->count);
 		break;
 
 	case Rwrite:
-		o = cbor_pack(&cbor_default_allocator, "u", (u64int)f->count);
-		break;
-
-	case Rclunk:
-	case Rremove:
-	case Rwstat:
-		o = cbor_pack(&cbor_default_allocator, "N");
+		cbor_put_uint(&w, f->count);
 		break;
 
 	case Rstat:
-		o = cbor_pack(&cbor_default_allocator, "b", f->nstat, f->stat);
+		cbor_put_byte(&w, f->stat, f->nstat);
 		break;
 	}
 
-	assert(o != nil);
-
-	c = cbor_pack(&cbor_default_allocator, "t[uc]", (u64int)f->type, (u64int)f->tag, o);
-
-	assert(c != nil);
-
-	sz = cbor_encode_size(c);
-
-	if(nap >= sz){
-		assert(cbor_encode(c, ap, nap) == sz);
-	}
-
-	cbor_free(&cbor_default_allocator, c);
-
-	return sz;
+	return w.n;
 }
 
+#define FSIZE(m)	sizeof(((Fcall*)0)->m)
+#define UINT(m)	{.type = CBOR_UINT, .off = CBOR_OFF(Fcall, m), .size = FSIZE(m)}
+#define INT(m)	{.type = CBOR_NINT, .off = CBOR_OFF(Fcall, m), .size = FSIZE(m)}
+#define STR(m)	{.type = CBOR_STRING, .off = CBOR_OFF(Fcall, m), .size = sizeof(char*)}
+#define BYTES(m, n)	{.type = CBOR_BYTE, .off = CBOR_OFF(Fcall, m), .size = sizeof(char*), \
+	.lenoff = CBOR_OFF(Fcall, n), .lensize = FSIZE(n)}
+#define ARRAY(a)	{.type = CBOR_ARRAY, .sub = a, .nsub = nelem(a)}
+
+static cbor_field fqid[] = {
+	{.type = CBOR_UINT, .off = CBOR_OFF(Qid, type), .size = sizeof(uchar)},
+	{.type = CBOR_UINT, .off = CBOR_OFF(Qid, vers), .size = sizeof(ulong)},
+	{.type = CBOR_UINT, .off = CBOR_OFF(Qid, path), .size = sizeof(uvlong)},
+};
+
+static cbor_field fversion[] = { UINT(msize), STR(version) };
+static cbor_field fauth[] = { UINT(afid), STR(uname), STR(aname) };
+static cbor_field fattach[] = { UINT(fid), UINT(afid), STR(uname), STR(aname) };
+static cbor_field fwalk[] = {
+	UINT(fid),
+	UINT(newfid),
+	{.type = CBOR_STRING, .flags = CBOR_FIELD_REPEAT, .off = CBOR_OFF(Fcall, wname), .size = sizeof(char*),
+		.lenoff = CBOR_OFF(Fcall, nwname), .lensize = FSIZE(nwname), .max = MAXWELEM},
+};
+static cbor_field fopen[] = { UINT(fid), UINT(mode) };
+static cbor_field fcreate[] = { UINT(fid), STR(name), UINT(perm), UINT(mode) };
+static cbor_field fread[] = { UINT(fid), INT(offset), UINT(count) };
+static cbor_field fwrite[] = { UINT(fid), INT(offset), BYTES(data, count) };
+static cbor_field fwstat[] = { UINT(fid), BYTES(stat, nstat) };
+static cbor_field fropen[] = { UINT(qid.type), UINT(qid.vers), UINT(qid.path), UINT(iounit) };
+
+/* the arguments of each message, after its tag */
+static cbor_field fargs[] = {
+[Tversion]	ARRAY(fversion),
+[Rversion]	ARRAY(fversion),
+[Tauth]	ARRAY(fauth),
+[Rauth]	{.type = CBOR_ARRAY, .off = CBOR_OFF(Fcall, aqid), .sub = fqid, .nsub = nelem(fqid)},
+[Tattach]	ARRAY(fattach),
+[Rattach]	{.type = CBOR_ARRAY, .off = CBOR_OFF(Fcall, qid), .sub = fqid, .nsub = nelem(fqid)},
+[Rerror]	STR(ename),
+[Tflush]	UINT(oldtag),
+[Rflush]	{.type = CBOR_NULL},
+[Twalk]	ARRAY(fwalk),
+[Rwalk]	{.type = CBOR_ARRAY, .flags = CBOR_FIELD_REPEAT, .off = CBOR_OFF(Fcall, wqid), .size = sizeof(Qid),
+		.lenoff = CBOR_OFF(Fcall, nwqid), .lensize = FSIZE(nwqid), .max = MAXWELEM,
+		.sub = fqid, .nsub = nelem(fqid)},
+[Topen]	ARRAY(fopen),
+[Ropen]	ARRAY(fropen),
+[Tcreate]	ARRAY(fcreate),
+[Rcreate]	ARRAY(fropen),
+[Tread]	ARRAY(fread),
+[Rread]	BYTES(data, count),
+[Twrite]	ARRAY(fwrite),
+[Rwrite]	UINT(count),
+[Tclunk]	UINT(fid),
+[Rclunk]	{.type = CBOR_NULL},
+[Tremove]	UINT(fid),
+[Rremove]	{.type = CBOR_NULL},
+[Tstat]	UINT(fid),
+[Rstat]	BYTES(stat, nstat),
+[Twstat]	ARRAY(fwstat),
+[Rwstat]	{.type = CBOR_NULL},
+};
+
+/* read type([tag, args]) straight from ap into f in one pass; nothing is allocated */
 uint
 convM2Scbor(uchar *ap, uint nap, Fcall *f)
 {
-	int len, len2;
-	u64int type, tag, msize, afid;
-	char *s, *s2;
-	cbor *c, *v;
-
-	c = cbor_decode(&cbor_default_allocator, ap, nap);
-	if(c == nil){
-		fprint(2, "decode M2S failed\n");
-		return 0;
-	}
-
-	if(cbor_unpack(&cbor_default_allocator, c, "t[uc]", &type, &tag, &v) < 0){
-		fprint(2, "unpack type/tag failed\n");
-		goto err;
-	}
+	cbor_cursor top, msg;
+	cbor_field body[2] = {
+		UINT(tag),
+	};
+	cbor_field fmsg = ARRAY(body);
 
-	f->type = type;
-	f->tag = tag;
+	cbor_cursor_init(&top, ap, nap);
 
-	switch(f->type){
-	default:
+	if(cbor_next(&top) != 1 || top.type != CBOR_TAG)
 		goto err;
 
-	case Rversion:
-	case Tversion:
-		if(cbor_unpack(&cbor_default_allocator, v, "[us]", &msize, &len, &s) < 0){
-			fprint(2, "unpack Tversion failed\n");
-			goto err;
-		}
-
-		f->msize = msize;
-		f->version = s;
-		break;
+	if(top.uint < Tversion || top.uint >= nelem(fargs) || top.uint == Terror){
+		werrstr("unsupported message type %llud", top.uint);
+		goto err;
+	}
 
-	case Tauth:
-		if(cbor_unpack(&cbor_default_allocator, v, "[uss]", &afid, &len, &s, &len2, &s2) < 0)
-			goto err;
+	f->type = top.uint;
+	body[1] = fargs[f->type];
 
-		f->afid = afid;
-		f->uname = s;
-		f->aname = s2;
-		break;
+	if(cbor_enter(&top, &msg) < 0 || cbor_next_struct(&msg, &fmsg, f) != 1)
+		goto err;
 
-	}
+	if(cbor_leave(&top, &msg) < 0)
+		goto err;
 
-	return 1;
+	return top.p - ap;
 
 err:
-	cbor_free(&cbor_default_allocator, c);
+	fprint(2, "convM2Scbor: %r\n");
 	return 0;
 }
 
@@ -0,0 +1,407 @@
+#include <u.h>
+#include <libc.h>
+
+#include "cbor.h"
+#include "cborimpl.h"
+
+/* cbor_cursor.left at the top level: read until the input ends */
+#define TOP	(~0ULL-1)
+
+static int majortype[] = {
+	CBOR_UINT, CBOR_NINT, CBOR_BYTE, CBOR_STRING, CBOR_ARRAY, CBOR_MAP, CBOR_TAG,
+};
+
+/*
+ * step over the chunks of an indefinite-length string of the
+ * given major type and its break. each must be a definite-length
+ * string of the same type.
+ */
+static uchar*
+skipchunks(uchar *p, uchar *e, int major)
+{
+	cbor_hdr h;
+
+	while(p < e && *p != 0xff){
+		p = cbor_head(p, e, &h);
+		if(p == nil)
+			return nil;
+
+		if(h.major != major || (h.op & 0x1f) == 31){
+			werrstr("bad chunk in indefinite-length string");
+			return nil;
+		}
+
+		if(h.arg > e - p){
+			werrstr("truncated string");
+			return nil;
+		}
+
+		p += h.arg;
+	}
+
+	if(p == e){
+		werrstr("truncated item");
+		return nil;
+	}
+
+	return p+1;
+}
+
+/*
+ * step over n items, including everything nested in them, or
+ * up to and past a break if n is INDEF. definite counts nest by
+ * adding up; what is left outside an open indefinite-length
+ * item waits on an explicit stack, along with whether it is a
+ * map, so the C stack stays flat. their depth is limited.
+ */
+uchar*
+cbor_skipn(uchar *p, uchar *e, u64int n)
+{
+	int sp;
+	u64int m, stk[CBOR_MAXDEPTH];
+	cbor_hdr h;
+
+	sp = 0;
+	if(n == INDEF){
+		stk[sp++] = 0;
+		n = 0;
+	} else if(n > e - p)
+		goto toolong;
+
+	for(;;){
+		if(n > 0)
+			n--;
+		else if(sp == 0)
+			return p;
+		else if(p < e && *p == 0xff){
+			n = stk[--sp] >> 1;
+			p++;
+			continue;
+		} else if(stk[sp-1] & 1){
+			/* a key in an indefinite-length map: its value follows */
+			n = 1;
+		}
+
+		p = cbor_head(p, e, &h);
+		if(p == nil)
+			return nil;
+
+		m = 0;
+
+		if((h.op & 0x1f) == 31){
+			if(h.major < 2 || h.major > 5){
+				werrstr("unexpected 0x%hhux", h.op);
+				return nil;
+			}
+
+			if(h.major < 4){
+				p = skipchunks(p, e, h.major);
+				if(p == nil)
+					return nil;
+				continue;
+			}
+
+			if(sp == CBOR_MAXDEPTH){
+				werrstr("nesting deeper than %d", CBOR_MAXDEPTH);
+				return nil;
+			}
+
+			stk[sp++] = n<<1 | (h.major == 5);
+			n = 0;
+			continue;
+		} else switch(h.major){
+		case 2: case 3:
+			if(h.arg > e - p){
+				werrstr("truncated string");
+				return nil;
+			}
+
+			p += h.arg;
+			break;
+
+		/* every item takes at least a byte, which bounds the lengths */
+		case 4:
+			if(h.arg > e - p)
+				goto toolong;
+			m = h.arg;
+			break;
+
+		case 5:
+			if(h.arg > (e - p) / 2)
+				goto toolong;
+			m = h.arg * 2;
+			break;
+
+		case 6:
+			m = 1;
+			break;
+		}
+
+		n += m;
+		if(n > e - p)
+			goto toolong;
+	}
+
+toolong:
+	werrstr("length exceeds input");
+	return nil;
+}
+
+/*
+ * step over count items at buf, nested ones included, without
+ * decoding them. returns the first byte after them, or nil if
+ * they are malformed or do not fit in n bytes.
+ */
+uchar*
+cbor_skip(uchar *buf, ulong n, ulong count)
+{
+	return cbor_skipn(buf, buf + n, count);
+}
+
+/* the encoded length of the item at buf, or -1 */
+long
+cbor_item_len(uchar *buf, ulong n)
+{
+	uchar *p;
+
+	p = cbor_skipn(buf, buf + n, 1);
+	if(p == nil)
+		return -1;
+
+	return p - buf;
+}
+
+/*
+ * find the items of the RFC 8742 sequence in buf, filling span
+ * with up to nspan of their offsets and lengths. returns the
+ * number found. it stops early at a malformed or truncated item,
+ * with the reason in the error string; the last span then ends
+ * before n although fewer than nspan were filled.
+ */
+long
+cbor_seq_split(uchar *buf, ulong n, cbor_span *span, long nspan)
+{
+	long i;
+	uchar *p, *q, *e;
+
+	p = buf;
+	e = buf + n;
+
+	for(i = 0; i < nspan && p < e; i++){
+		q = cbor_skipn(p, e, 1);
+		if(q == nil)
+			break;
+
+		span[i].off = p - buf;
+		span[i].len = q - p;
+		p = q;
+	}
+
+	return i;
+}
+
+void
+cbor_cursor_init(cbor_cursor *cur, uchar *buf, ulong n)
+{
+	memset(cur, 0, sizeof(*cur));
+
+	cur->p = buf;
+	cur->e = buf + n;
+	cur->left = TOP;
+	cur->type = -1;
+}
+
+/*
+ * move to the next item at this level, stepping over the
+ * children of the current one unless they were entered.
+ * returns 1 with the item in cur, 0 at the end of the enclosing
+ * container or input, and -1 on malformed input.
+ */
+int
+cbor_next(cbor_cursor *cur)
+{
+	u32int fv;
+	uchar *p;
+	cbor_hdr h;
+
+	if(cur->skip > 0){
+		p = cbor_skipn(cur->p, cur->e, cur->skip);
+		if(p == nil)
+			return -1;
+
+		cur->p = p;
+		cur->skip = 0;
+	}
+
+	if(cur->left == INDEF && cur->p < cur->e && *cur->p == 0xff){
+		cur->p++;
+		cur->left = 0;
+		return 0;
+	}
+
+	if(cur->left == 0 || (cur->left == TOP && cur->p == cur->e))
+		return 0;
+
+	p = cbor_head(cur->p, cur->e, &h);
+	if(p == nil)
+		return -1;
+
+	cur->item = cur->p;
+	cur->flags = 0;
+	if((h.op & 0x1f) == 31){
+		if(h.major < 2 || h.major > 5)
+			goto unknown;
+		cur->flags = CBOR_FLAG_INDEFINITE;
+	}
+
+	cur->p = p;
+	if(cur->left != TOP && cur->left != INDEF)
+		cur->left--;
+
+	cur->uint = h.arg;
+	cur->len = 0;
+	cur->byte = nil;
+
+	/* indefinite-length items are read by entering them */
+	if(cur->flags & CBOR_FLAG_INDEFINITE){
+		cur->type = majortype[h.major];
+		cur->uint = 0;
+		cur->skip = INDEF;
+		return 1;
+	}
+
+	switch(h.major){
+	case 0:
+		cur->type = CBOR_UINT;
+		break;
+
+	case 1:
+		cur->type = CBOR_NINT;
+		break;
+
+	case 2: case 3:
+		if(h.arg > cur->e - p){
+			werrstr("truncated string");
+			return -1;
+		}
+
+		cur->type = h.major == 2 ? CBOR_BYTE : CBOR_STRING;
+		cur->len = h.arg;
+		cur->byte = p;
+		cur->p += h.arg;
+		break;
+
+	case 4:
+		if(h.arg > cur->e - p)
+			goto toolong;
+
+		cur->type = CBOR_ARRAY;
+		cur->len = h.arg;
+		cur->skip = h.arg;
+		break;
+
+	case 5:
+		if(h.arg > (cur->e - p) / 2)
+			goto toolong;
+
+		cur->type = CBOR_MAP;
+		cur->len = h.arg;
+		cur->skip = h.arg * 2;
+		break;
+
+	case 6:
+		cur->type = CBOR_TAG;
+		cur->skip = 1;
+		break;
+
+	case 7:
+		switch(h.op){
+		default:
+			goto unknown;
+
+		case 0xf6:
+			cur->type = CBOR_NULL;
+			break;
+
+		case 0xf9:
+			cur->type = CBOR_DOUBLE;
+			cur->d = cbor_half(h.arg);
+			break;
+
+		case 0xfa:
+			cur->type = CBOR_FLOAT;
+			fv = h.arg;
+			memcpy(&cur->f, &fv, 4);
+			break;
+
+		case 0xfb:
+			cur->type = CBOR_DOUBLE;
+			memcpy(&cur->d, &h.arg, 8);
+			break;
+		}
+		break;
+	}
+
+	return 1;
+
+toolong:
+	werrstr("length exceeds input");
+	return -1;
+
+unknown:
+	werrstr("type %hhud not implemented", h.op);
+	return -1;
+}
+
+/*
+ * iterate over the children of the current array, map or tag
+ * with sub. map keys and values come in turn, and the chunks of
+ * an indefinite-length string are its children. call cbor_leave
+ * before moving cur again.
+ */
+int
+cbor_enter(cbor_cursor *cur, cbor_cursor *sub)
+{
+	switch(cur->type){
+	default:
+		werrstr("not a container");
+		return -1;
+
+	case CBOR_BYTE:
+	case CBOR_STRING:
+		if((cur->flags & CBOR_FLAG_INDEFINITE) == 0){
+			werrstr("not a container");
+			return -1;
+		}
+		break;
+
+	case CBOR_ARRAY:
+	case CBOR_MAP:
+	case CBOR_TAG:
+		break;
+	}
+
+	cbor_cursor_init(sub, cur->p, cur->e - cur->p);
+	sub->left = cur->skip;
+	cur->skip = 0;
+
+	return 0;
+}
+
+/* skip what is left of sub and continue after it in cur */
+int
+cbor_leave(cbor_cursor *cur, cbor_cursor *sub)
+{
+	uchar *p;
+
+	p = cbor_skipn(sub->p, sub->e, sub->skip);
+	if(p != nil)
+		p = cbor_skipn(p, sub->e, sub->left);
+	if(p == nil)
+		return -1;
+
+	cur->p = p;
+	sub->skip = sub->left = 0;
+
+	return 0;
+}
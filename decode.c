@@ -6,14 +6,12 @@
 
 #define OPSIZE(base, op) (1<<(-((base) - (op))))
 
-static cbor *dec_tab(cbor_coder *d);
-
 uchar*
 cbor_take(cbor_coder *d, long want)
 {
 	uchar *p;
 
-	if(d->e - d->p < want)
+	if(d->e - d->p < want && (!d->grow || cbor_grow(d, want) < 0))
 		return nil;
 
 	p = d->p;
@@ -21,29 +19,239 @@ cbor_take(cbor_coder *d, long want)
 	return p;
 }
 
+/* bytes in the header starting with op, argument included */
+static int
+dec_hdrlen(uchar op)
+{
+	op &= 0x1f;
+
+	if(op >= 24 && op < 28)
+		return 1 + (1<<(op-24));
+
+	return 1;
+}
+
+/*
+ * ran out of input. an incremental decoder suspends and waits
+ * for more; otherwise the item is truncated.
+ */
 static cbor*
-dec_size(cbor_coder *d, int n, cbor *(*decf)(cbor_coder*, u64int))
+dec_short(cbor_coder *d)
 {
-	int i;
-	u64int len;
+	if(d->partial)
+		d->more = 1;
+	else
+		werrstr("truncated item");
+
+	return nil;
+}
+
+/* is the next item decoded a map key? */
+static int
+dec_iskey(cbor_coder *d)
+{
+	cbor_frame *f;
+
+	if(d->sp == 0)
+		return 0;
+
+	f = &d->stk[d->sp-1];
+
+	return f->hook == nil && f->c->type == CBOR_MAP && (f->i & 1) == 0;
+}
+
+/*
+ * a byte or text string continues past the end of the input.
+ * keep what there is and let dec_fill complete it from the
+ * following chunks. its storage grows as they arrive, rather
+ * than trusting the declared length up front.
+ */
+static cbor*
+dec_str_partial(cbor_coder *d, u64int len, int typ)
+{
+	ulong n;
+	cbor *c;
+
+	if(!d->partial)
+		return dec_short(d);
+
+	n = d->e - d->p;
+
+	if(typ == CBOR_BYTE)
+		c = cbor_make_byte(d->alloc, d->p, n);
+	else
+		c = cbor_make_string(d->alloc, (char*)d->p, n);
+	if(c == nil)
+		return nil;
+
+	d->p = d->e;
+	d->str = c;
+	d->nstr = n;
+	d->lstr = len;
+
+	return dec_short(d);
+}
+
+static cbor*
+dec_fill(cbor_coder *d)
+{
+	ulong n, cap;
 	uchar *p;
+	cbor *c;
 
-	p = cbor_take(d, n);
-	if(p == nil)
+	c = d->str;
+
+	n = d->e - d->p;
+	if(n > d->lstr - d->nstr)
+		n = d->lstr - d->nstr;
+
+	if(d->nstr + n > c->len){
+		cap = c->len * 2;
+		if(cap < d->nstr + n)
+			cap = d->nstr + n;
+		if(cap > d->lstr)
+			cap = d->lstr;
+
+		p = d->alloc->realloc(d->alloc->context, c->byte, c->len, cap);
+		if(p == nil)
+			return nil;
+
+		c->byte = p;
+		c->len = cap;
+	}
+
+	memmove(c->byte + d->nstr, d->p, n);
+	d->p += n;
+	d->nstr += n;
+
+	if(d->nstr < d->lstr)
+		return dec_short(d);
+
+	d->str = nil;
+
+	/* a key split across chunks is interned once it is whole */
+	if(c->type == CBOR_STRING && d->intern != nil && dec_iskey(d)){
+		p = (uchar*)cbor_intern_str(d->intern, c->string, c->len);
+		if(p != nil){
+			d->alloc->free(d->alloc->context, c->byte);
+			c->byte = p;
+			c->flags |= CBOR_FLAG_BORROWED|CBOR_FLAG_INTERNED;
+		}
+	}
+
+	return c;
+}
+
+/*
+ * check the declared length of an array or map against the
+ * limits and, unless more input may follow, against the bytes
+ * left, each element taking at least size of them. returns the
+ * slots to allocate now; the rest are grown as they arrive.
+ */
+static vlong
+dec_len(cbor_coder *d, u64int len, int size)
+{
+	u64int left;
+
+	if(len > 0x7fffffff || (d->lim.maxlen != 0 && len > d->lim.maxlen)){
+		werrstr("length %llud over limit", len);
+		return -1;
+	}
+
+	left = (d->e - d->p) / size;
+	if(len <= left)
+		return len;
+
+	if(!d->partial){
+		werrstr("length exceeds input");
+		return -1;
+	}
+
+	return left;
+}
+
+static int
+dec_strlen(cbor_coder *d, u64int len)
+{
+	if(len > 0x7fffffff || (d->lim.maxstring != 0 && len > d->lim.maxstring)){
+		werrstr("string length %llud over limit", len);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* big-endian loads, which compilers turn into a load and a byte swap */
+#define BE16(p)	((u16int)(p)[0]<<8 | (p)[1])
+#define BE32(p)	((u32int)(p)[0]<<24 | (u32int)(p)[1]<<16 | (u32int)(p)[2]<<8 | (p)[3])
+#define BE64(p)	((u64int)BE32(p)<<32 | BE32((p)+4))
+
+/* big-endian argument of n bytes */
+static u64int
+dec_be(uchar *p, int n)
+{
+	switch(n){
+	case 1:
+		return p[0];
+	case 2:
+		return BE16(p);
+	case 4:
+		return BE32(p);
+	case 8:
+		return BE64(p);
+	}
+
+	return 0;
+}
+
+/*
+ * parse the header at p into h. returns the first byte after it,
+ * or nil if it does not fit before e or is malformed.
+ */
+uchar*
+cbor_head(uchar *p, uchar *e, cbor_hdr *h)
+{
+	int n;
+
+	if(p >= e || e - p < dec_hdrlen(*p)){
+		werrstr("truncated item");
 		return nil;
+	}
+
+	h->op = *p;
+	h->major = *p >> 5;
+
+	n = dec_hdrlen(*p++);
+	if(n == 1){
+		h->arg = h->op & 0x1f;
+		if(h->arg >= 28 && h->arg < 31){
+			werrstr("reserved additional information %d", (int)h->arg);
+			return nil;
+		}
+	} else {
+		h->arg = dec_be(p, n-1);
+	}
+
+	return p + n-1;
+}
 
-	len = 0;
+static cbor*
+dec_size(cbor_coder *d, int n, cbor *(*decf)(cbor_coder*, u64int))
+{
+	uchar *p;
 
 	switch(n){
 	case 1: case 2: case 4: case 8:
-		for(i = 0; i < n; i++)
-			len |= (u64int)p[i] << (n-1-i)*8;
 		break;
 	default:
 		return nil;
 	}
 
-	return decf(d, len);
+	p = cbor_take(d, n);
+	if(p == nil)
+		return nil;
+
+	return decf(d, dec_be(p, n));
 }
 
 static cbor*
@@ -64,17 +272,19 @@ dec_u(cbor_coder *d)
 	return dec_size(d, OPSIZE(0x18, d->p[-1]), dec_u_common);
 }
 
-static u64int signedmax = (2ULL<<63ULL) - 1;
-
 static cbor*
 dec_n_common(cbor_coder *d, u64int v)
 {
-	if(v > signedmax){
-		werrstr("negative out of range");
+	cbor *c;
+
+	/* v is -1-n, as kept in c->uint */
+	c = cbor_make_uint(d->alloc, v);
+	if(c == nil)
 		return nil;
-	}
 
-	return cbor_make_nint(d->alloc, v+1);
+	c->type = CBOR_NINT;
+
+	return c;
 }
 
 static cbor*
@@ -94,9 +304,15 @@ dec_b_common(cbor_coder *d, u64int len)
 {
 	uchar *p;
 
+	if(dec_strlen(d, len) < 0)
+		return nil;
+
 	p = cbor_take(d, len);
 	if(p == nil)
-		return nil;
+		return dec_str_partial(d, len, CBOR_BYTE);
+
+	if(d->flags & CBOR_DECODE_BORROW)
+		return cbor_make_byte_ref(d->alloc, p, len);
 
 	return cbor_make_byte(d->alloc, p, len);
 }
@@ -117,10 +333,29 @@ static cbor*
 dec_string_common(cbor_coder *d, u64int len)
 {
 	uchar *p;
+	char *s;
+	cbor *c;
+
+	if(dec_strlen(d, len) < 0)
+		return nil;
 
 	p = cbor_take(d, len);
 	if(p == nil)
-		return nil;
+		return dec_str_partial(d, len, CBOR_STRING);
+
+	/* keys the table will not take are copied as usual */
+	if(d->intern != nil && dec_iskey(d)){
+		s = cbor_intern_str(d->intern, (char*)p, len);
+		if(s != nil){
+			c = cbor_make_string_ref(d->alloc, s, len);
+			if(c != nil)
+				c->flags |= CBOR_FLAG_INTERNED;
+			return c;
+		}
+	}
+
+	if(d->flags & CBOR_DECODE_BORROW)
+		return cbor_make_string_ref(d->alloc, (char*)p, len);
 
 	return cbor_make_string(d->alloc, (char*)p, len);
 }
@@ -137,33 +372,92 @@ dec_string(cbor_coder *d)
 	return dec_size(d, OPSIZE(0x78, d->p[-1]), dec_string_common);
 }
 
-static cbor*
-dec_a_common(cbor_coder *d, u64int len)
+/*
+ * containers are not decoded recursively. opening one pushes a
+ * frame on d->stk, and dec_run attaches the following items to
+ * it until it is full.
+ */
+static cbor_frame*
+dec_frame(cbor_coder *d, u64int n)
 {
-	u64int i;
-
-	cbor *c, *e;
+	int nstk;
+	cbor_frame *stk, *f;
 
-	c = cbor_make_array(d->alloc, len);
-	if(c == nil)
+	if(d->sp >= d->maxdepth){
+		werrstr("nesting deeper than %d", d->maxdepth);
 		return nil;
+	}
 
-	for(i = 0; i < len; i++){
-		e = dec_tab(d);
-		if(e == nil)
-			goto fail;
+	if(d->sp == d->nstk){
+		nstk = d->nstk * 2;
+		if(nstk > d->maxdepth)
+			nstk = d->maxdepth;
+
+		if(d->stk == d->stk0){
+			stk = d->alloc->alloc(d->alloc->context, nstk * sizeof(cbor_frame));
+			if(stk != nil)
+				memmove(stk, d->stk, d->nstk * sizeof(cbor_frame));
+		} else {
+			stk = d->alloc->realloc(d->alloc->context, d->stk,
+				d->nstk * sizeof(cbor_frame), nstk * sizeof(cbor_frame));
+		}
+
+		if(stk == nil)
+			return nil;
 
-		c->array[i] = e;
+		d->stk = stk;
+		d->nstk = nstk;
 	}
 
+	f = &d->stk[d->sp++];
+	f->c = nil;
+	f->i = 0;
+	f->n = n;
+	f->k = nil;
+	f->hook = nil;
+
+	return f;
+}
+
+static cbor*
+dec_push(cbor_coder *d, cbor *c, u64int n)
+{
+	cbor_frame *f;
+
+	f = dec_frame(d, n);
+	if(f == nil)
+		goto fail;
+
+	f->c = c;
+
 	return c;
 
 fail:
+	/* none of the slots have been filled yet */
+	if(c->type != CBOR_TAG)
+		c->len = 0;
 	cbor_free(d->alloc, c);
 
 	return nil;
 }
 
+static cbor*
+dec_a_common(cbor_coder *d, u64int len)
+{
+	vlong n;
+	cbor *c;
+
+	n = dec_len(d, len, 1);
+	if(n < 0)
+		return nil;
+
+	c = cbor_make_array(d->alloc, n);
+	if(c == nil || len == 0)
+		return c;
+
+	return dec_push(d, c, len);
+}
+
 static cbor*
 dec_alit(cbor_coder *d)
 {
@@ -179,41 +473,19 @@ dec_a(cbor_coder *d)
 static cbor*
 dec_m_common(cbor_coder *d, u64int len)
 {
-	u64int i;
-
-	cbor *c, *e, *k, *v;
+	vlong n;
+	cbor *c;
 
-	c = cbor_make_map(d->alloc, len);
-	if(c == nil)
+	n = dec_len(d, len, 2);
+	if(n < 0)
 		return nil;
 
-	for(i = 0; i < len; i++){
-		k = dec_tab(d);
-		if(k == nil)
-			goto fail;
-
-		v = dec_tab(d);
-		if(v == nil){
-			cbor_free(d->alloc, k);
-			goto fail;
-		}
-
-		e = cbor_make_map_element(d->alloc, k, v);
-		if(e == nil){
-			cbor_free(d->alloc, k);
-			cbor_free(d->alloc, v);
-			goto fail;
-		}
-
-		c->array[i] = e;
-	}
-
-	return c;
-
-fail:
-	cbor_free(d->alloc, c);
+	c = cbor_make_map(d->alloc, n);
+	if(c == nil || len == 0)
+		return c;
 
-	return nil;
+	/* keys and values each take a slot */
+	return dec_push(d, c, len * 2);
 }
 
 static cbor*
@@ -231,19 +503,25 @@ dec_m(cbor_coder *d)
 static cbor*
 dec_t_common(cbor_coder *d, u64int tag)
 {
-	cbor *c, *e;
-
-	e = dec_tab(d);
-	if(e == nil)
-		return nil;
+	int i;
+	cbor *c;
+	cbor_frame *f;
+
+	/* a hooked tag opens a frame without a node; see dec_hook */
+	for(i = 0; i < d->nhooks; i++){
+		if(d->hooks[i].tag == tag){
+			f = dec_frame(d, 1);
+			if(f != nil)
+				f->hook = &d->hooks[i];
+			return nil;
+		}
+	}
 
-	c = cbor_make_tag(d->alloc, tag, e);
-	if(c == nil){
-		cbor_free(d->alloc, e);
+	c = cbor_make_tag(d->alloc, tag, nil);
+	if(c == nil)
 		return nil;
-	}
 
-	return c;
+	return dec_push(d, c, 1);
 }
 
 static cbor*
@@ -258,29 +536,162 @@ dec_t(cbor_coder *d)
 	return dec_size(d, OPSIZE(0xd8, d->p[-1]), dec_t_common);
 }
 
+/*
+ * indefinite-length items stay open until a break. strings
+ * either keep their chunks as children or, with
+ * CBOR_DECODE_COALESCE, have them appended into one string.
+ * none can be a chunk of a string, and a coalescing string
+ * is not marked indefinite, so dec_put cannot tell; check here.
+ */
+static cbor*
+dec_indef(cbor_coder *d, int typ)
+{
+	cbor *c;
+	cbor_frame *f;
+
+	if(d->sp > 0){
+		f = &d->stk[d->sp-1];
+		if(f->hook == nil && (f->c->type == CBOR_BYTE || f->c->type == CBOR_STRING)){
+			werrstr("bad chunk in indefinite-length string");
+			return nil;
+		}
+	}
+
+	if(typ == CBOR_MAP)
+		c = cbor_make_map(d->alloc, 0);
+	else if(typ == CBOR_ARRAY || (d->flags & CBOR_DECODE_COALESCE) == 0)
+		c = cbor_make_array(d->alloc, 0);
+	else
+		c = cbor_make_byte(d->alloc, d->p, 0);
+	if(c == nil)
+		return nil;
+
+	c->type = typ;
+	if((typ != CBOR_BYTE && typ != CBOR_STRING) || (d->flags & CBOR_DECODE_COALESCE) == 0)
+		c->flags |= CBOR_FLAG_INDEFINITE;
+
+	return dec_push(d, c, INDEF);
+}
+
+static cbor*
+dec_bindef(cbor_coder *d)
+{
+	return dec_indef(d, CBOR_BYTE);
+}
+
+static cbor*
+dec_stringindef(cbor_coder *d)
+{
+	return dec_indef(d, CBOR_STRING);
+}
+
+static cbor*
+dec_aindef(cbor_coder *d)
+{
+	return dec_indef(d, CBOR_ARRAY);
+}
+
+static cbor*
+dec_mindef(cbor_coder *d)
+{
+	return dec_indef(d, CBOR_MAP);
+}
+
+/* with CBOR_DECODE_INDEX, index a map that is complete */
+static int
+dec_index(cbor_coder *d, cbor *c)
+{
+	if((d->flags & CBOR_DECODE_INDEX) == 0 || c->type != CBOR_MAP || c->len < CBOR_INDEXMIN)
+		return 0;
+
+	return cbor_map_index(d->alloc, c);
+}
+
+/* close the innermost indefinite-length item */
+static cbor*
+dec_break(cbor_coder *d)
+{
+	ulong n, sz;
+	void *p;
+	cbor *c;
+	cbor_frame *f;
+
+	if(d->sp == 0 || d->stk[d->sp-1].n != INDEF){
+		werrstr("unexpected break");
+		return nil;
+	}
+
+	f = &d->stk[d->sp-1];
+	c = f->c;
+
+	if(c->type == CBOR_MAP && (f->i & 1) != 0){
+		werrstr("break after map key");
+		return nil;
+	}
+
+	/* trim the slots or bytes that were grown ahead */
+	if(c->flags & CBOR_FLAG_INDEFINITE){
+		n = c->type == CBOR_MAP ? f->i/2 : f->i;
+		sz = sizeof(cbor*);
+	} else {
+		n = f->i;
+		sz = 1;
+	}
+
+	if(n < c->len){
+		p = d->alloc->realloc(d->alloc->context, c->array, c->len * sz, n * sz);
+		if(p == nil && n > 0)
+			return nil;
+		if(p != nil)
+			c->array = p;
+	}
+
+	c->len = n;
+	if(dec_index(d, c) < 0)
+		return nil;
+	d->sp--;
+
+	return c;
+}
+
 static cbor*
 dec_null(cbor_coder *d)
 {
 	return cbor_make_null(d->alloc);
 }
 
-static cbor*
-dec_half_v(cbor_coder *d, u64int v)
+double
+cbor_half(u16int v)
 {
-	int exp, mant;
+	int exp;
+	u64int mant, bits;
 	double dub;
 
 	exp = (v>>10) & 0x1f;
 	mant = v & 0x3ff;
 
-	if(exp == 0)
-		dub = ldexp(mant, -24);
-	else if(exp != 31)
-		dub = ldexp(mant + 1024, exp - 25);
+	/* subnormal: mant * 2^-24, exact in a double */
+	if(exp == 0){
+		dub = (double)mant * (1.0/16777216.0);
+		return (v & 0x8000) ? -dub : dub;
+	}
+
+	/* rebias the exponent and widen the mantissa; keeps NaN payloads */
+	bits = (u64int)(v & 0x8000) << 48 | mant << 42;
+	if(exp == 31)
+		bits |= 0x7ffULL << 52;
 	else
-		dub = mant == 0 ? Inf(0) : NaN();
+		bits |= (u64int)(exp - 15 + 1023) << 52;
 
-	return cbor_make_double(d->alloc, (v & 0x8000) ? -dub : dub);
+	memcpy(&dub, &bits, 8);
+
+	return dub;
+}
+
+static cbor*
+dec_half_v(cbor_coder *d, u64int v)
+{
+	return cbor_make_double(d->alloc, cbor_half(v));
 }
 
 static cbor*
@@ -413,6 +824,7 @@ static cbor *(*decfuns[256])(cbor_coder *d) = {
 [0x59]	dec_b,
 [0x5a]	dec_b,
 [0x5b]	dec_b,
+[0x5f]	dec_bindef,
 
 /* major type 3 */
 [0x60]	dec_stringlit,
@@ -443,6 +855,7 @@ static cbor *(*decfuns[256])(cbor_coder *d) = {
 [0x79]	dec_string,
 [0x7a]	dec_string,
 [0x7b]	dec_string,
+[0x7f]	dec_stringindef,
 
 /* major type 4 */
 [0x80]	dec_alit,
@@ -473,6 +886,7 @@ static cbor *(*decfuns[256])(cbor_coder *d) = {
 [0x99]	dec_a,
 [0x9a]	dec_a,
 [0x9b]	dec_a,
+[0x9f]	dec_aindef,
 
 /* major type 5 */
 [0xa0]	dec_mlit,
@@ -503,6 +917,7 @@ static cbor *(*decfuns[256])(cbor_coder *d) = {
 [0xb9]	dec_m,
 [0xba]	dec_m,
 [0xbb]	dec_m,
+[0xbf]	dec_mindef,
 
 /* major type 6 */
 [0xc0]  dec_tlit,
@@ -539,19 +954,20 @@ static cbor *(*decfuns[256])(cbor_coder *d) = {
 [0xf9]	dec_half,
 [0xfa]	dec_f,
 [0xfb]	dec_d,
+[0xff]	dec_break,
 };
 
 static cbor*
 dec_tab(cbor_coder *d)
 {
-	uchar *p, op;
+	uchar op;
 	cbor *(*f)(cbor_coder *d);
 
-	p = cbor_take(d, 1);
-	if(p == nil)
-		return nil;
+	/* the whole header must be there before anything is consumed */
+	if(d->p >= d->e || d->e - d->p < dec_hdrlen(*d->p))
+		return dec_short(d);
 
-	op = *p;
+	op = *d->p++;
 
 	f = decfuns[op];
 
@@ -563,15 +979,1072 @@ dec_tab(cbor_coder *d)
 	return f(d);
 }
 
-cbor*
-cbor_decode(cbor_allocator *alloc, uchar *buf, ulong n)
+/*
+ * the fast engine reads each initial byte from one table instead
+ * of calling through decfuns and dec_size: what kind of item it
+ * starts and how many bytes of argument follow. kinds below DHALF
+ * are the major types, with DINDEF added for indefinite lengths.
+ */
+enum {
+	DTAG = 6,
+	DHALF = 8,
+	DFLOAT,
+	DDOUBLE,
+	DNULL,
+	DBREAK,
+	DBAD,
+
+	DINDEF = 0x10,
+};
+
+typedef struct dec_op dec_op;
+struct dec_op {
+	uchar	kind;
+	uchar	size;
+};
+
+#define IMM(k)	{k, 0}
+#define IMM8(k)	IMM(k), IMM(k), IMM(k), IMM(k), IMM(k), IMM(k), IMM(k), IMM(k)
+#define BAD	{DBAD, 0}
+#define MAJOR(k, indef) \
+	IMM8(k), IMM8(k), IMM8(k), {k, 1}, {k, 2}, {k, 4}, {k, 8}, BAD, BAD, BAD, indef
+
+static dec_op dectab[256] = {
+	MAJOR(CBOR_UINT, BAD),
+	MAJOR(CBOR_NINT, BAD),
+	MAJOR(CBOR_BYTE, IMM(CBOR_BYTE|DINDEF)),
+	MAJOR(CBOR_STRING, IMM(CBOR_STRING|DINDEF)),
+	MAJOR(CBOR_ARRAY, IMM(CBOR_ARRAY|DINDEF)),
+	MAJOR(CBOR_MAP, IMM(CBOR_MAP|DINDEF)),
+	MAJOR(DTAG, BAD),
+
+	/* major type 7: only null, floats and break */
+	BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD,
+	BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD,
+	BAD, BAD, BAD, BAD, BAD, BAD, IMM(DNULL), BAD,
+	BAD, {DHALF, 2}, {DFLOAT, 4}, {DDOUBLE, 8}, BAD, BAD, BAD, IMM(DBREAK),
+};
+
+static cbor*
+dec_item(cbor_coder *d)
 {
-	cbor_coder d = {
-		.alloc = alloc,
-		.s = buf,
-		.p = buf,
-		.e = buf + n,
-	};
+	uchar *p;
+	u64int v;
+	dec_op op;
+
+	p = d->p;
+
+	/* the whole header must be there before anything is consumed */
+	if(p >= d->e)
+		return dec_short(d);
+
+	op = dectab[*p];
+	if(op.size == 0){
+		v = *p & 0x1f;
+		d->p = p + 1;
+
+		/* the commonest items: small ints */
+		if(op.kind == CBOR_UINT)
+			return cbor_make_uint(d->alloc, v);
+	} else {
+		if(d->e - p <= op.size)
+			return dec_short(d);
+
+		if(op.size == 1)
+			v = p[1];
+		else if(op.size == 2)
+			v = BE16(p+1);
+		else if(op.size == 4)
+			v = BE32(p+1);
+		else
+			v = BE64(p+1);
+		d->p = p + 1 + op.size;
+	}
+
+	switch(op.kind){
+	case CBOR_UINT:
+		return cbor_make_uint(d->alloc, v);
+	case CBOR_NINT:
+		return dec_n_common(d, v);
+	case CBOR_BYTE:
+		return dec_b_common(d, v);
+	case CBOR_STRING:
+		return dec_string_common(d, v);
+	case CBOR_ARRAY:
+		return dec_a_common(d, v);
+	case CBOR_MAP:
+		return dec_m_common(d, v);
+	case DTAG:
+		return dec_t_common(d, v);
+	case CBOR_BYTE|DINDEF:
+		return dec_indef(d, CBOR_BYTE);
+	case CBOR_STRING|DINDEF:
+		return dec_indef(d, CBOR_STRING);
+	case CBOR_ARRAY|DINDEF:
+		return dec_indef(d, CBOR_ARRAY);
+	case CBOR_MAP|DINDEF:
+		return dec_indef(d, CBOR_MAP);
+	case DHALF:
+		return dec_half_v(d, v);
+	case DFLOAT:
+		return dec_f_v(d, v);
+	case DDOUBLE:
+		return dec_d_v(d, v);
+	case DNULL:
+		return cbor_make_null(d->alloc);
+	case DBREAK:
+		return dec_break(d);
+	}
+
+	werrstr("type %hhud not implemented", *p);
+	return nil;
+}
+
+/*
+ * make room for slot i of a container that was not allocated
+ * whole, whose len counts the slots allocated so far. it never
+ * grows beyond max slots.
+ */
+static int
+dec_grow(cbor_coder *d, cbor *c, u64int i, ulong sz, u64int max)
+{
+	u64int n;
+	void *p;
+
+	if(i < c->len)
+		return 0;
+
+	n = c->len * 2;
+	if(n <= i)
+		n = i + 8;
+	if(n > max)
+		n = max;
+	if(n > 0x7fffffff){
+		werrstr("length over limit");
+		return -1;
+	}
+
+	p = d->alloc->realloc(d->alloc->context, c->array, c->len * sz, n * sz);
+	if(p == nil)
+		return -1;
+
+	c->array = p;
+	c->len = n;
+
+	return 0;
+}
+
+/*
+ * store c in the next slot of the container in f. on failure c
+ * is freed; whatever f holds is left for dec_unwind.
+ */
+static int
+dec_put(cbor_coder *d, cbor_frame *f, cbor *c)
+{
+	cbor *e;
+
+	/* a hooked tag holds its item until the hook takes it */
+	if(f->hook != nil){
+		f->k = c;
+		f->i++;
+		return 0;
+	}
+
+	switch(f->c->type){
+	default:
+		abort();
 
-	return dec_tab(&d);
+	case CBOR_BYTE:
+	case CBOR_STRING:
+		if(c->type != f->c->type || (c->flags & CBOR_FLAG_INDEFINITE) != 0){
+			werrstr("bad chunk in indefinite-length string");
+			goto fail;
+		}
+
+		if(f->c->flags & CBOR_FLAG_INDEFINITE)
+			goto array;
+
+		if(d->lim.maxstring != 0 && f->i + c->len > d->lim.maxstring){
+			werrstr("string length over limit");
+			goto fail;
+		}
+
+		if(c->len > 0 && dec_grow(d, f->c, f->i + c->len - 1, 1, INDEF) < 0)
+			goto fail;
+
+		memmove(f->c->byte + f->i, c->byte, c->len);
+		f->i += c->len;
+		cbor_free(d->alloc, c);
+		return 0;
+
+	case CBOR_ARRAY:
+	array:
+		if(f->n == INDEF && d->lim.maxlen != 0 && f->i >= d->lim.maxlen)
+			goto toolong;
+
+		if(dec_grow(d, f->c, f->i, sizeof(cbor*), f->n) < 0)
+			goto fail;
+
+		f->c->array[f->i] = c;
+		break;
+
+	case CBOR_MAP:
+		if((f->i & 1) == 0){
+			f->k = c;
+			break;
+		}
+
+		if(f->n == INDEF && d->lim.maxlen != 0 && f->i / 2 >= d->lim.maxlen)
+			goto toolong;
+
+		if(dec_grow(d, f->c, f->i / 2, sizeof(cbor*), f->n == INDEF ? INDEF : f->n / 2) < 0)
+			goto fail;
+
+		e = cbor_make_map_element(d->alloc, f->k, c);
+		if(e == nil)
+			goto fail;
+
+		f->c->array[f->i / 2] = e;
+		f->k = nil;
+		break;
+
+	case CBOR_TAG:
+		f->c->item = c;
+		break;
+	}
+
+	f->i++;
+
+	return 0;
+
+toolong:
+	werrstr("length over limit");
+fail:
+	cbor_free(d->alloc, c);
+	return -1;
+}
+
+/* free the partially decoded items still held by d */
+static void
+dec_unwind(cbor_coder *d)
+{
+	cbor_frame *f;
+
+	cbor_free(d->alloc, d->str);
+	d->str = nil;
+
+	while(d->sp > 0){
+		f = &d->stk[--d->sp];
+
+		if(f->hook != nil){
+			cbor_free(d->alloc, f->k);
+			continue;
+		}
+
+		switch(f->c->type){
+		case CBOR_BYTE:
+		case CBOR_STRING:
+			if(f->c->flags & CBOR_FLAG_INDEFINITE)
+				f->c->len = f->i;
+			break;
+
+		case CBOR_ARRAY:
+			f->c->len = f->i;
+			break;
+
+		case CBOR_MAP:
+			f->c->len = f->i / 2;
+			cbor_free(d->alloc, f->k);
+			break;
+		}
+
+		cbor_free(d->alloc, f->c);
+	}
+}
+
+/* pass the item of the hooked tag in f, just closed, to its hook */
+static cbor*
+dec_hook(cbor_coder *d, cbor_frame *f)
+{
+	cbor *c;
+
+	c = f->hook->fn(d->alloc, f->hook->tag, f->k, f->hook->arg);
+	if(c == nil)
+		cbor_free(d->alloc, f->k);
+
+	return c;
+}
+
+/*
+ * the end of an array or map at d->p that is to be kept encoded,
+ * or nil if it is to be decoded. one truncated or malformed is
+ * decoded as usual, which fails.
+ */
+static uchar*
+dec_rawend(cbor_coder *d)
+{
+	int major;
+
+	if(d->p >= d->e)
+		return nil;
+
+	major = *d->p >> 5;
+	if(major != 4 && major != 5)
+		return nil;
+
+	return cbor_skipn(d->p, d->e, 1);
+}
+
+static cbor*
+dec_raw(cbor_coder *d, uchar *e)
+{
+	cbor *c;
+
+	/* dec_rawend has checked it */
+	if(d->flags & CBOR_DECODE_BORROW)
+		c = cbor_make_byte_ref(d->alloc, d->p, e - d->p);
+	else
+		c = cbor_make_byte(d->alloc, d->p, e - d->p);
+	if(c == nil)
+		return nil;
+
+	c->type = CBOR_RAW;
+	d->p = e;
+
+	return c;
+}
+
+static cbor*
+dec_run(cbor_coder *d)
+{
+	int sp;
+	uchar *e;
+	cbor *c;
+	cbor_frame *f;
+
+	d->more = 0;
+
+	/* a new item; nothing is allocated for it yet */
+	if(d->sp == 0 && d->str == nil)
+		d->nalloc = 0;
+
+	for(;;){
+		sp = d->sp;
+
+		if(d->str != nil)
+			c = dec_fill(d);
+		else if(d->sp+1 == d->rawdepth && (e = dec_rawend(d)) != nil)
+			c = dec_raw(d, e);
+		else if(d->flags & CBOR_DECODE_REFERENCE)
+			c = dec_tab(d);
+		else
+			c = dec_item(d);
+
+		/* a container was opened; its children come next */
+		if(d->sp > sp)
+			continue;
+
+		if(c == nil){
+			if(d->more)
+				return nil;
+			goto fail;
+		}
+
+		/* c is complete; close every container it fills up */
+		for(;;){
+			if(d->sp == 0)
+				return c;
+
+			f = &d->stk[d->sp-1];
+
+			/* the fast engine fills definite arrays without dec_put */
+			if(f->hook == nil && f->c->type == CBOR_ARRAY && f->n != INDEF
+			&& f->i < f->c->len && (d->flags & CBOR_DECODE_REFERENCE) == 0)
+				f->c->array[f->i++] = c;
+			else if(dec_put(d, f, c) < 0)
+				goto fail;
+
+			if(f->i < f->n)
+				break;
+
+			d->sp--;
+
+			c = f->hook != nil ? dec_hook(d, f) : f->c;
+			if(c == nil)
+				goto fail;
+			if(dec_index(d, c) < 0){
+				cbor_free(d->alloc, c);
+				goto fail;
+			}
+		}
+	}
+
+fail:
+	dec_unwind(d);
+
+	return nil;
+}
+
+static cbor*
+dec_stack(cbor_coder *d, uchar *buf, ulong n)
+{
+	dec_unwind(d);
+
+	d->s = buf;
+	d->p = buf;
+	d->e = buf + n;
+	d->partial = 0;
+
+	return dec_run(d);
+}
+
+static void
+dec_freestack(cbor_coder *d)
+{
+	if(d->stk != d->stk0)
+		d->alloc->free(d->alloc->context, d->stk);
+
+	d->stk = d->stk0;
+	d->nstk = CBOR_NSTACK;
+}
+
+/* with maxalloc set, everything allocated passes through these */
+static int
+lim_charge(cbor_coder *d, ulong n)
+{
+	if(n > d->lim.maxalloc - d->nalloc){
+		werrstr("allocation over limit");
+		return -1;
+	}
+
+	d->nalloc += n;
+
+	return 0;
+}
+
+static void*
+lim_alloc(void *context, ulong size)
+{
+	cbor_coder *d;
+
+	d = context;
+	if(lim_charge(d, size) < 0)
+		return nil;
+
+	return d->real->alloc(d->real->context, size);
+}
+
+static void*
+lim_realloc(void *context, void *optr, ulong osize, ulong size)
+{
+	cbor_coder *d;
+
+	d = context;
+	if(size > osize && lim_charge(d, size - osize) < 0)
+		return nil;
+
+	return d->real->realloc(d->real->context, optr, osize, size);
+}
+
+static void
+lim_free(void *context, void *ptr)
+{
+	cbor_coder *d;
+
+	d = context;
+	d->real->free(d->real->context, ptr);
+}
+
+/* set up d to allocate from alloc within lim, which may be nil */
+static void
+dec_limits(cbor_coder *d, cbor_allocator *alloc, cbor_limits *lim)
+{
+	if(lim != nil)
+		d->lim = *lim;
+	else
+		memset(&d->lim, 0, sizeof(d->lim));
+
+	d->maxdepth = d->lim.maxdepth > 0 ? d->lim.maxdepth : CBOR_MAXDEPTH;
+	d->real = alloc;
+	d->alloc = alloc;
+
+	if(d->lim.maxalloc != 0){
+		d->counted.alloc = lim_alloc;
+		d->counted.realloc = lim_realloc;
+		d->counted.free = lim_free;
+		d->counted.context = d;
+		d->alloc = &d->counted;
+	}
+}
+
+static cbor*
+dec_oneshot(cbor_allocator *alloc, uchar *buf, ulong n, int flags, cbor_limits *lim, ulong *used)
+{
+	cbor *c;
+	cbor_frame stk[CBOR_NSTACK];
+	cbor_coder d = {
+		.flags = flags,
+		.stk = stk,
+		.stk0 = stk,
+		.nstk = nelem(stk),
+	};
+
+	dec_limits(&d, alloc, lim);
+
+	c = dec_stack(&d, buf, n);
+	dec_freestack(&d);
+
+	if(c != nil && used != nil)
+		*used = d.p - buf;
+
+	return c;
+}
+
+cbor*
+cbor_decode(cbor_allocator *alloc, uchar *buf, ulong n)
+{
+	return dec_oneshot(alloc, buf, n, 0, nil, nil);
+}
+
+/*
+ * decode the first item of an RFC 8742 sequence in buf and set
+ * *used to its encoded length; the next item starts there.
+ */
+cbor*
+cbor_decode_seq(cbor_allocator *alloc, uchar *buf, ulong n, ulong *used)
+{
+	return dec_oneshot(alloc, buf, n, 0, nil, used);
+}
+
+/*
+ * decode without copying byte and text strings; they point
+ * into buf, which must stay valid until the tree is freed.
+ */
+cbor*
+cbor_decode_borrow(cbor_allocator *alloc, uchar *buf, ulong n)
+{
+	return dec_oneshot(alloc, buf, n, CBOR_DECODE_BORROW, nil, nil);
+}
+
+/*
+ * decode within the limits in lim. declared lengths are checked
+ * against the input before anything is allocated for them.
+ */
+cbor*
+cbor_decode_limits(cbor_allocator *alloc, uchar *buf, ulong n, cbor_limits *lim)
+{
+	return dec_oneshot(alloc, buf, n, 0, lim, nil);
+}
+
+/*
+ * a cbor_decoder keeps its work stack between calls, so a
+ * long-lived one only allocates when it meets a new record depth.
+ */
+cbor_decoder*
+cbor_decoder_new(cbor_allocator *alloc, int flags, cbor_limits *lim)
+{
+	cbor_decoder *dec;
+
+	dec = alloc->alloc(alloc->context, sizeof(*dec));
+	if(dec == nil)
+		return nil;
+
+	memset(dec, 0, sizeof(*dec));
+	dec->d.flags = flags;
+	dec->d.stk = dec->stk;
+	dec->d.stk0 = dec->stk;
+	dec->d.nstk = nelem(dec->stk);
+	dec_limits(&dec->d, alloc, lim);
+
+	return dec;
+}
+
+void
+cbor_decoder_free(cbor_decoder *dec)
+{
+	cbor_allocator *alloc;
+
+	if(dec == nil)
+		return;
+
+	alloc = dec->d.real;
+
+	dec_unwind(&dec->d);
+	dec_freestack(&dec->d);
+	if(dec->d.hooks != nil)
+		alloc->free(alloc->context, dec->d.hooks);
+	alloc->free(alloc->context, dec);
+}
+
+/*
+ * decode the items dec finds under tag through fn rather than
+ * into CBOR_TAG nodes. fn is given the tagged item once it is
+ * decoded, and returns the node that stands for the whole in
+ * the tree, which may be item itself, or nil on error. if it
+ * succeeds item is fn's to keep or free; if not, the decoder
+ * frees it. a second hook for a tag replaces the first.
+ */
+int
+cbor_decoder_hook(cbor_decoder *dec, u64int tag,
+	cbor *(*fn)(cbor_allocator*, u64int, cbor*, void*), void *arg)
+{
+	int i;
+	cbor_coder *d;
+	cbor_taghook *h;
+	cbor_allocator *a;
+
+	d = &dec->d;
+
+	for(i = 0; i < d->nhooks; i++)
+		if(d->hooks[i].tag == tag)
+			break;
+
+	if(i == d->nhooks){
+		/* open frames point into the hooks */
+		if(d->sp > 0){
+			werrstr("decoder is in the middle of an item");
+			return -1;
+		}
+
+		a = d->real;
+		if(d->hooks == nil)
+			h = a->alloc(a->context, sizeof(*h));
+		else
+			h = a->realloc(a->context, d->hooks, i * sizeof(*h), (i+1) * sizeof(*h));
+		if(h == nil)
+			return -1;
+
+		d->hooks = h;
+		d->nhooks++;
+	}
+
+	d->hooks[i].tag = tag;
+	d->hooks[i].fn = fn;
+	d->hooks[i].arg = arg;
+
+	return 0;
+}
+
+/*
+ * share the text map keys dec decodes from tab, which must
+ * outlive the trees; nil stops it. equal keys the table takes
+ * (see cbor_intern_str) then have the same bytes, and can be
+ * told apart by pointer; the rest are copied as usual.
+ */
+void
+cbor_decoder_intern(cbor_decoder *dec, cbor_intern *tab)
+{
+	dec->d.intern = tab;
+}
+
+/*
+ * keep the arrays and maps dec meets at depth, 0 being the root
+ * and tags counting as a level, encoded as CBOR_RAW nodes rather
+ * than decoding them; a negative depth stops it. with
+ * CBOR_DECODE_BORROW they point into the input. like borrowing,
+ * this cannot be done with cbor_decoder_feed, where the shape of
+ * the tree would depend on where the chunks break.
+ */
+void
+cbor_decoder_raw(cbor_decoder *dec, int depth)
+{
+	dec->d.rawdepth = depth < 0 ? 0 : depth+1;
+}
+
+cbor*
+cbor_decoder_decode(cbor_decoder *dec, uchar *buf, ulong n)
+{
+	dec->nhold = 0;
+
+	return dec_stack(&dec->d, buf, n);
+}
+
+/* continue the suspended decode of dec over buf[0:n] */
+static cbor*
+dec_resume(cbor_decoder *dec, uchar *buf, ulong n)
+{
+	cbor_coder *d;
+
+	d = &dec->d;
+	d->s = buf;
+	d->p = buf;
+	d->e = buf + n;
+	d->partial = 1;
+
+	return dec_run(d);
+}
+
+/*
+ * incremental decoding. buf[0:n] is the next chunk of input;
+ * the previous chunks need not be kept. returns the number of
+ * bytes used, and sets *rc once a complete item has been decoded.
+ * the bytes after it have not been used and start the next item.
+ * when all of buf was used and *rc is nil, more input is needed.
+ * on error the partial item is discarded and -1 returned.
+ */
+long
+cbor_decoder_feed(cbor_decoder *dec, uchar *buf, ulong n, cbor **rc)
+{
+	ulong m, used;
+	cbor *c;
+	cbor_coder *d;
+
+	d = &dec->d;
+	*rc = nil;
+
+	if(d->flags & CBOR_DECODE_BORROW){
+		werrstr("cannot borrow from chunks");
+		return -1;
+	}
+
+	if(d->rawdepth != 0){
+		werrstr("cannot keep raw items from chunks");
+		return -1;
+	}
+
+	used = 0;
+
+	/* complete a header that was split across chunks */
+	if(dec->nhold > 0){
+		m = dec_hdrlen(dec->hold[0]) - dec->nhold;
+		if(m > n)
+			m = n;
+
+		memmove(dec->hold + dec->nhold, buf, m);
+		dec->nhold += m;
+		used += m;
+
+		if(dec->nhold < dec_hdrlen(dec->hold[0]))
+			return used;
+
+		c = dec_resume(dec, dec->hold, dec->nhold);
+		dec->nhold = 0;
+
+		if(c != nil){
+			*rc = c;
+			return used;
+		}
+
+		if(!d->more)
+			return -1;
+	}
+
+	c = dec_resume(dec, buf + used, n - used);
+	if(c != nil){
+		*rc = c;
+		return d->p - buf;
+	}
+
+	if(!d->more)
+		return -1;
+
+	/* at most a partial header is left over */
+	m = d->e - d->p;
+	assert(m < sizeof(dec->hold));
+	memmove(dec->hold, d->p, m);
+	dec->nhold = m;
+
+	return n;
+}
+
+/* flat blocks are 8-byte aligned, and never empty so each has its own address */
+#define FLATSZ(n)	((n) == 0 ? 8 : ((n) + 7) & ~7ULL)
+
+/* what cbor_decode_flat allocates for an indefinite item of n slots */
+static uvlong
+scan_grown(u64int n)
+{
+	uvlong sz, cap;
+
+	/*
+	 * dec_grow doubles from 8; every block it outgrew stays in
+	 * the arena, and trimming at the break is done in place.
+	 */
+	sz = FLATSZ(0);
+	for(cap = 8; ; cap *= 2){
+		sz += FLATSZ(cap * sizeof(cbor*));
+		if(cap >= n)
+			break;
+	}
+
+	return sz;
+}
+
+/*
+ * check that buf starts with one well-formed item and count what
+ * decoding it takes. nothing is allocated unless the item nests
+ * deeper than CBOR_NSTACK.
+ */
+int
+cbor_scan(cbor_allocator *a, uchar *buf, ulong n, cbor_scaninfo *si)
+{
+	int sp;
+	uchar *p, *e;
+	uvlong size;
+	cbor_hdr h;
+	cbor_frame *f, stk[CBOR_NSTACK];
+	cbor_coder d = {
+		.alloc = a,
+		.stk = stk,
+		.stk0 = stk,
+		.nstk = nelem(stk),
+		.maxdepth = CBOR_MAXDEPTH,
+	};
+
+	memset(si, 0, sizeof(*si));
+
+	p = buf;
+	e = buf + n;
+	size = 0;
+
+	for(;;){
+		p = cbor_head(p, e, &h);
+		if(p == nil)
+			goto fail;
+
+		sp = d.sp;
+		f = sp > 0 ? &d.stk[sp-1] : nil;
+
+		if(h.op == 0xff){
+			if(f == nil || f->n != INDEF || (f->major == 5 && (f->i & 1) != 0)){
+				werrstr("unexpected break");
+				goto fail;
+			}
+
+			if(f->major == 5){
+				si->nodes += f->i/2;
+				size += f->i/2 * FLATSZ(sizeof(cbor));
+				size += scan_grown(f->i/2);
+			} else {
+				size += scan_grown(f->i);
+			}
+
+			d.sp--;
+			goto done;
+		}
+
+		if(f != nil && f->n == INDEF && (f->major == 2 || f->major == 3)
+		&& (h.major != f->major || (h.op & 0x1f) == 31)){
+			werrstr("bad chunk in indefinite-length string");
+			goto fail;
+		}
+
+		si->nodes++;
+		size += FLATSZ(sizeof(cbor));
+
+		if((h.op & 0x1f) == 31){
+			if(h.major < 2 || h.major > 5){
+				werrstr("type %hhud not implemented", h.op);
+				goto fail;
+			}
+
+			if(dec_frame(&d, INDEF) == nil)
+				goto fail;
+			d.stk[d.sp-1].major = h.major;
+		} else switch(h.major){
+		case 2: case 3:
+			if(h.arg > e - p){
+				werrstr("truncated item");
+				goto fail;
+			}
+
+			p += h.arg;
+			si->bytes += h.arg;
+			size += FLATSZ(h.arg);
+			break;
+
+		case 4: case 5:
+			if(h.arg > (e - p) / (h.major == 4 ? 1 : 2)){
+				werrstr("length exceeds input");
+				goto fail;
+			}
+
+			size += FLATSZ(h.arg * sizeof(cbor*));
+			if(h.major == 5){
+				si->nodes += h.arg;
+				size += h.arg * FLATSZ(sizeof(cbor));
+			}
+
+			if(h.arg == 0)
+				break;
+
+			if(dec_frame(&d, h.major == 4 ? h.arg : h.arg * 2) == nil)
+				goto fail;
+			d.stk[d.sp-1].major = h.major;
+			break;
+
+		case 6:
+			if(dec_frame(&d, 1) == nil)
+				goto fail;
+			d.stk[d.sp-1].major = h.major;
+			break;
+
+		case 7:
+			switch(h.op){
+			case 0xf6: case 0xf9: case 0xfa: case 0xfb:
+				break;
+			default:
+				werrstr("type %hhud not implemented", h.op);
+				goto fail;
+			}
+			break;
+		}
+
+		if(d.sp > si->depth)
+			si->depth = d.sp;
+
+		/* opened a container; its children come next */
+		if(d.sp > sp)
+			continue;
+
+	done:
+		/* the item is complete; close what it fills */
+		while(d.sp > 0){
+			f = &d.stk[d.sp-1];
+			f->i++;
+			if(f->i < f->n)
+				break;
+			d.sp--;
+		}
+
+		if(d.sp == 0)
+			break;
+	}
+
+	dec_freestack(&d);
+
+	if(size > (ulong)~0UL){
+		werrstr("item too large");
+		return -1;
+	}
+
+	si->len = p - buf;
+	si->size = size;
+
+	return 0;
+
+fail:
+	d.sp = 0;
+	dec_freestack(&d);
+
+	return -1;
+}
+
+typedef struct flat flat;
+struct flat {
+	uchar	*p, *e;
+	uchar	*last;	/* most recent allocation, which may grow in place */
+};
+
+static void*
+flat_alloc(void *context, ulong size)
+{
+	flat *fl;
+
+	fl = context;
+	size = FLATSZ(size);
+
+	if(fl->e - fl->p < size)
+		return nil;
+
+	fl->last = fl->p;
+	fl->p += size;
+
+	return fl->last;
+}
+
+static void*
+flat_realloc(void *context, void *optr, ulong osize, ulong size)
+{
+	void *p;
+	flat *fl;
+
+	fl = context;
+
+	if(optr == fl->last && fl->e - fl->last >= FLATSZ(size)){
+		fl->p = fl->last + FLATSZ(size);
+		return optr;
+	}
+
+	if(size <= osize)
+		return optr;
+
+	p = flat_alloc(context, size);
+	if(p != nil)
+		memmove(p, optr, osize);
+
+	return p;
+}
+
+static void
+flat_free(void *context, void *ptr)
+{
+	USED(context, ptr);
+}
+
+/*
+ * decode into a single block sized by cbor_scan, so the tree has
+ * one allocation and its nodes sit together in memory. the root
+ * is at the start of the block; cbor_free on it frees the lot.
+ * only the root is marked CBOR_FLAG_FLAT, so the nodes below it
+ * must not be freed or grown: no cbor_free, cbor_array_append,
+ * cbor_map_append or cbor_map_index on them.
+ */
+cbor*
+cbor_decode_flat(cbor_allocator *alloc, uchar *buf, ulong n)
+{
+	uchar *blk;
+	cbor *c;
+	cbor_scaninfo si;
+	cbor_frame stk0[CBOR_NSTACK], *stk;
+	flat fl;
+	cbor_allocator fa = {
+		.alloc		= flat_alloc,
+		.realloc	= flat_realloc,
+		.free		= flat_free,
+		.context	= &fl,
+	};
+	cbor_coder d = {
+		.alloc = &fa,
+		.maxdepth = CBOR_MAXDEPTH,
+	};
+
+	if(cbor_scan(alloc, buf, n, &si) < 0)
+		return nil;
+
+	/* the work stack is sized up front, so it never grows into the block */
+	stk = stk0;
+	if(si.depth > nelem(stk0)){
+		stk = alloc->alloc(alloc->context, si.depth * sizeof(cbor_frame));
+		if(stk == nil)
+			return nil;
+	}
+
+	d.stk = d.stk0 = stk;
+	d.nstk = si.depth > nelem(stk0) ? si.depth : nelem(stk0);
+
+	blk = alloc->alloc(alloc->context, si.size);
+	if(blk == nil){
+		c = nil;
+		goto out;
+	}
+
+	fl.p = blk;
+	fl.e = blk + si.size;
+	fl.last = nil;
+
+	c = dec_stack(&d, buf, si.len);
+	if(c == nil){
+		alloc->free(alloc->context, blk);
+		goto out;
+	}
+
+	assert((uchar*)c == blk);
+	c->flags |= CBOR_FLAG_FLAT;
+
+out:
+	if(stk != stk0)
+		alloc->free(alloc->context, stk);
+
+	return c;
 }
@@ -6,62 +6,304 @@
 
 typedef ulong (*encfun)(cbor_coder *d, cbor *c, int justsize);
 
+/* the largest finite single-precision float */
+#define FLTMAX	3.40282346638528859812e+38
+
 static ulong cbor_enc(cbor_coder *d, cbor *c, int justsize);
 
-static ulong
-enc_size(cbor_coder *d, u64int v, uchar major, int justsize)
+static int
+canon(cbor_coder *d)
 {
-	ulong n;
-	uchar *p;
+	return d != nil && (d->flags & CBOR_ENC_CANON) != 0;
+}
 
-	if(v < 24){
-		n = 1;
-		major |= v;
-	} else if(v < 0x100ULL){
-		n = 2;
-		major |= 24;
-	} else if(v < 0x10000ULL){
-		n = 3;
-		major |= 25;
-	} else if(v < 0x100000000ULL){
-		n = 5;
-		major |= 26;
-	} else {
-		n = 9;
-		major |= 27;
-	}
+static int
+cached(cbor_coder *d)
+{
+	return d != nil && (d->flags & CBOR_ENC_CACHE) != 0;
+}
 
-	if(justsize)
-		return n;
+static int
+shortfloats(cbor_coder *d)
+{
+	return d != nil && (d->flags & CBOR_ENC_SHORT) != 0;
+}
 
-	p = cbor_take(d, n);
-	if(p == nil)
-		return 0;
+/* bytes in the header of an item with argument v */
+int
+cbor_headlen(u64int v)
+{
+	if(v < 24)
+		return 1;
+	if(v < 0x100ULL)
+		return 2;
+	if(v < 0x10000ULL)
+		return 3;
+	if(v < 0x100000000ULL)
+		return 5;
+	return 9;
+}
 
-	*p++ = major;
+/* write the shortest header of major type major with argument v at p */
+int
+cbor_puthead(uchar *p, uchar major, u64int v)
+{
+	return cbor_putheadn(p, major, v, cbor_headlen(v));
+}
 
+/* write the n byte header of major type major with argument v at p; v must fit */
+int
+cbor_putheadn(uchar *p, uchar major, u64int v, int n)
+{
 	switch(n){
 	default:
 		abort();
+	case 1:
+		*p = major | v;
+		break;
+	case 2:
+		*p++ = major | 24;
+		*p = v;
+		break;
+	case 3:
+		*p++ = major | 25;
+		*p++ = v >> 8;
+		*p = v;
+		break;
+	case 5:
+		*p++ = major | 26;
+		*p++ = v >> 24;
+		*p++ = v >> 16;
+		*p++ = v >> 8;
+		*p = v;
+		break;
 	case 9:
+		*p++ = major | 27;
 		*p++ = v >> 56;
 		*p++ = v >> 48;
 		*p++ = v >> 40;
 		*p++ = v >> 32;
-	case 5:
 		*p++ = v >> 24;
 		*p++ = v >> 16;
-	case 3:
 		*p++ = v >> 8;
-	case 2:
 		*p = v;
-	case 1:
-		;
+		break;
 	}
 
 	return n;
 }
 
+/*
+ * the shortest of half, single and double precision that holds
+ * v exactly: returns its size in bytes, 2, 4 or 8, and its bits
+ * in *bits. every NaN is the one half-precision quiet NaN.
+ */
+static int
+shortfloat(double v, u64int *bits)
+{
+	int e, shift;
+	u32int fb, m, sign;
+	float f;
+
+	if(isNaN(v)){
+		*bits = 0x7e00;
+		return 2;
+	}
+
+	/* narrowing what a float cannot hold is undefined */
+	if(fabs(v) > FLTMAX && !isInf(v, 0)){
+		memcpy(bits, &v, 8);
+		return 8;
+	}
+
+	f = v;
+	if(f != v){
+		memcpy(bits, &v, 8);
+		return 8;
+	}
+
+	memcpy(&fb, &f, 4);
+	*bits = fb;
+
+	sign = fb>>16 & 0x8000;
+	e = (fb>>23 & 0xff) - 127;
+	m = fb & 0x7fffff;
+
+	/* zero, and infinity */
+	if((fb & 0x7fffffff) == 0 || (e == 128 && m == 0)){
+		*bits = sign | (e == 128 ? 0x7c00 : 0);
+		return 2;
+	}
+
+	/* normal halves */
+	if(e >= -14 && e <= 15){
+		if(m & 0x1fff)
+			return 4;
+		*bits = sign | (e+15)<<10 | m>>13;
+		return 2;
+	}
+
+	/* subnormal halves: the implicit bit joins the mantissa */
+	if(e >= -24 && e < -14){
+		m |= 1<<23;
+		shift = 13 + (-14 - e);
+		if(m & ((1<<shift)-1))
+			return 4;
+		*bits = sign | m>>shift;
+		return 2;
+	}
+
+	return 4;
+}
+
+/* bytes in the shortest float that holds v exactly */
+int
+cbor_floatlen(double v)
+{
+	u64int bits;
+
+	return 1 + shortfloat(v, &bits);
+}
+
+/* write v as the shortest float that holds it exactly at p */
+int
+cbor_putfloat(uchar *p, double v)
+{
+	int n;
+	u64int bits;
+
+	n = shortfloat(v, &bits);
+
+	return cbor_putheadn(p, 7<<5, bits, 1+n);
+}
+
+static ulong
+enc_size(cbor_coder *d, u64int v, uchar major, int justsize)
+{
+	ulong n;
+	uchar *p;
+
+	n = cbor_headlen(v);
+	if(justsize)
+		return n;
+
+	p = cbor_take(d, n);
+	if(p == nil)
+		return 0;
+
+	cbor_puthead(p, major, v);
+
+	return n;
+}
+
+static ulong
+enc_op(cbor_coder *d, uchar op, int justsize)
+{
+	uchar *p;
+
+	if(justsize)
+		return 1;
+
+	p = cbor_take(d, 1);
+	if(p == nil)
+		return 0;
+
+	*p = op;
+
+	return 1;
+}
+
+/* an indefinite-length item: the initial byte, the children, a break */
+static ulong
+enc_indef(cbor_coder *d, cbor *c, uchar major, int justsize)
+{
+	int i;
+	ulong rv, r;
+
+	rv = enc_op(d, major | 31, justsize);
+	if(rv == 0)
+		return 0;
+
+	for(i = 0; i < c->len; i++){
+		r = cbor_enc(d, c->array[i], justsize);
+		if(r == 0)
+			return 0;
+		rv += r;
+	}
+
+	r = enc_op(d, 0xff, justsize);
+	if(r == 0)
+		return 0;
+
+	return rv + r;
+}
+
+/* an indefinite-length string as one definite-length string */
+static ulong
+enc_joined(cbor_coder *d, cbor *c, uchar major)
+{
+	int i;
+	ulong rv, n;
+	uchar *p;
+	cbor *s;
+
+	n = 0;
+	for(i = 0; i < c->len; i++)
+		n += c->array[i]->len;
+
+	rv = enc_size(d, n, major, 0);
+	if(rv == 0)
+		return 0;
+
+	p = cbor_take(d, n);
+	if(p == nil)
+		return 0;
+
+	for(i = 0; i < c->len; i++){
+		s = c->array[i];
+		memmove(p, s->byte, s->len);
+		p += s->len;
+	}
+
+	return rv + n;
+}
+
+static int
+enc_seg(cbor_coder *d, uchar *p, ulong n)
+{
+	if(d->nseg == d->maxseg){
+		werrstr("out of segments");
+		return -1;
+	}
+
+	d->seg[d->nseg].p = p;
+	d->seg[d->nseg].n = n;
+	d->nseg++;
+
+	return 0;
+}
+
+/* p[0:n] to the output, by reference if it is long enough */
+static int
+enc_copy(cbor_coder *d, uchar *p, ulong n)
+{
+	uchar *o;
+
+	if(d->seg != nil && n >= d->segmin){
+		if(d->p > d->mark && enc_seg(d, d->mark, d->p - d->mark) < 0)
+			return -1;
+		d->mark = d->p;
+		return enc_seg(d, p, n);
+	}
+
+	o = cbor_take(d, n);
+	if(o == nil)
+		return -1;
+	memmove(o, p, n);
+
+	return 0;
+}
+
 static ulong
 enc_u(cbor_coder *d, cbor *c, int justsize)
 {
@@ -71,14 +313,19 @@ enc_u(cbor_coder *d, cbor *c, int justsize)
 static ulong
 enc_n(cbor_coder *d, cbor *c, int justsize)
 {
-	return enc_size(d, c->uint-1, 1<<5, justsize);
+	return enc_size(d, c->uint, 1<<5, justsize);
 }
 
 static ulong
 enc_data_common(cbor_coder *d, cbor *c, uchar major, int justsize)
 {
 	ulong rv;
-	uchar *p;
+
+	if(c->flags & CBOR_FLAG_INDEFINITE){
+		if(canon(d))
+			return enc_joined(d, c, major);
+		return enc_indef(d, c, major, justsize);
+	}
 
 	rv = enc_size(d, c->len, major, justsize);
 	if(rv == 0)
@@ -87,8 +334,8 @@ enc_data_common(cbor_coder *d, cbor *c, uchar major, int justsize)
 	if(justsize)
 		return rv + c->len;
 
-	p = cbor_take(d, c->len);
-	memmove(p, c->byte, c->len);
+	if(enc_copy(d, c->byte, c->len) < 0)
+		return 0;
 
 	return rv + c->len;
 }
@@ -105,19 +352,155 @@ enc_string(cbor_coder *d, cbor *c, int justsize)
 	return enc_data_common(d, c, 3<<5, justsize);
 }
 
+/* a lazy array or map is still encoded; copy it through */
 static ulong
-enc_array_common(cbor_coder *d, cbor *c, uchar major, int justsize)
+enc_lazy(cbor_coder *d, cbor *c, int justsize)
 {
+	ulong n;
+	uchar *p;
+
+	p = cbor_skipn(c->enc, c->ence, 1);
+	if(p == nil)
+		return 0;
+
+	n = p - c->enc;
+	if(justsize)
+		return n;
+
+	if(enc_copy(d, c->enc, n) < 0)
+		return 0;
 
+	return n;
+}
+
+/* a map key, encoded once for sorting */
+typedef struct ckey ckey;
+struct ckey {
+	uchar	*p;
+	ulong	n;
+	cbor	*v;
+};
+
+static int
+ckeycmp(void *a, void *b)
+{
+	int r;
+	ckey *x, *y;
+
+	x = a;
+	y = b;
+
+	r = memcmp(x->p, y->p, x->n < y->n ? x->n : y->n);
+	if(r != 0)
+		return r;
+	if(x->n != y->n)
+		return x->n < y->n ? -1 : 1;
+	return 0;
+}
+
+/*
+ * the elements of a map in the order of their encoded keys, as
+ * RFC 8949 4.2.1 has it. the keys are encoded once, into kd, and
+ * copied out after the sort; equal keys are an error.
+ */
+static ulong
+enc_sorted(cbor_coder *d, cbor *c)
+{
 	int i;
 	ulong rv, r;
+	uchar kbuf[256], *p;
+	ckey kstk[16], *k;
+	cbor *e;
+	cbor_allocator *a;
+	cbor_coder kd = {
+		.alloc = d->alloc,
+		.flags = d->flags,
+		.s = kbuf,
+		.p = kbuf,
+		.e = kbuf + sizeof(kbuf),
+		.grow = 1,
+	};
 
-	rv = enc_size(d, c->len, major, justsize);
-	if(rv == 0)
+	a = d->alloc;
+	rv = 0;
+
+	k = kstk;
+	if(c->len > nelem(kstk)){
+		k = a->alloc(a->context, c->len * sizeof(ckey));
+		if(k == nil)
+			return 0;
+	}
+
+	/* kd moves as it grows; n holds each key's offset until it is done */
+	for(i = 0; i < c->len; i++){
+		e = c->array[i];
+		k[i].n = kd.p - kd.s;
+		r = cbor_enc(&kd, e->key, 0);
+		if(r == 0)
+			goto out;
+		k[i].p = nil;
+		k[i].v = e->value;
+	}
+
+	for(i = 0; i < c->len; i++){
+		k[i].p = kd.s + k[i].n;
+		k[i].n = (i+1 < c->len ? kd.s + k[i+1].n : kd.p) - k[i].p;
+	}
+
+	qsort(k, c->len, sizeof(ckey), ckeycmp);
+
+	for(i = 0; i < c->len; i++){
+		if(i > 0 && ckeycmp(&k[i-1], &k[i]) == 0){
+			werrstr("duplicate map key");
+			rv = 0;
+			goto out;
+		}
+
+		p = cbor_take(d, k[i].n);
+		if(p == nil){
+			rv = 0;
+			goto out;
+		}
+		memmove(p, k[i].p, k[i].n);
+
+		r = cbor_enc(d, k[i].v, 0);
+		if(r == 0){
+			rv = 0;
+			goto out;
+		}
+		rv += k[i].n + r;
+	}
+
+out:
+	if(kd.own)
+		a->free(a->context, kd.s);
+	if(k != kstk)
+		a->free(a->context, k);
+
+	return rv;
+}
+
+/* an array or map in deterministic form: expanded, definite, sorted */
+static ulong
+enc_canon(cbor_coder *d, cbor *c, uchar major)
+{
+	int i;
+	ulong rv, r;
+
+	if((c->flags & CBOR_FLAG_LAZY) != 0 && cbor_expand(d->alloc, c) < 0)
 		return 0;
 
+	rv = enc_size(d, c->len, major, 0);
+	if(rv == 0 || c->len == 0)
+		return rv;
+
+	if(major == 5<<5){
+		r = enc_sorted(d, c);
+		return r == 0 ? 0 : rv + r;
+	}
+
 	for(i = 0; i < c->len; i++){
-		r = cbor_enc(d, c->array[i], justsize);
+		r = cbor_enc(d, c->array[i], 0);
 		if(r == 0)
 			return 0;
 		rv += r;
@@ -126,6 +509,45 @@ enc_array_common(cbor_coder *d, cbor *c, uchar major, int justsize)
 	return rv;
 }
 
+static ulong
+enc_array_common(cbor_coder *d, cbor *c, uchar major, int justsize)
+{
+
+	int i;
+	ulong rv, r;
+
+	if(canon(d))
+		return enc_canon(d, c, major);
+
+	if(cached(d) && (c->flags & CBOR_FLAG_SIZED) != 0)
+		return c->esize;
+
+	if(c->flags & CBOR_FLAG_LAZY)
+		rv = enc_lazy(d, c, justsize);
+	else if(c->flags & CBOR_FLAG_INDEFINITE)
+		rv = enc_indef(d, c, major, justsize);
+	else {
+		rv = enc_size(d, c->len, major, justsize);
+		if(rv == 0)
+			return 0;
+
+		for(i = 0; i < c->len; i++){
+			r = cbor_enc(d, c->array[i], justsize);
+			if(r == 0)
+				return 0;
+			rv += r;
+		}
+	}
+
+	/* remembered until c is appended to or touched */
+	if(cached(d) && rv != 0 && rv == (u32int)rv){
+		c->esize = rv;
+		c->flags |= CBOR_FLAG_SIZED;
+	}
+
+	return rv;
+}
+
 static ulong
 enc_a(cbor_coder *d, cbor *c, int justsize)
 {
@@ -164,35 +586,41 @@ enc_t(cbor_coder *d, cbor *c, int justsize)
 		return 0;
 
 	e = cbor_enc(d, c->item, justsize);
-	if(t == 0)
+	if(e == 0)
 		return 0;
 
 	return t + e;
 }
 
+/* copied through as it is; its form is not known, so not canonically */
 static ulong
-enc_null(cbor_coder *d, cbor *c, int justsize)
+enc_raw(cbor_coder *d, cbor *c, int justsize)
 {
-	uchar *p;
-
-	(void)c;
+	if(canon(d)){
+		werrstr("raw item cannot be encoded canonically");
+		return 0;
+	}
 
 	if(justsize)
-		return 1;
+		return c->len;
 
-	p = cbor_take(d, 1);
-	if(p == nil)
+	if(enc_copy(d, c->byte, c->len) < 0)
 		return 0;
 
-	*p = 0xf6;
+	return c->len;
+}
 
-	return 1;
+static ulong
+enc_null(cbor_coder *d, cbor *c, int justsize)
+{
+	(void)c;
+
+	return enc_op(d, 0xf6, justsize);
 }
 
 static ulong
-enc_f(cbor_coder *d, cbor *c, int justsize)
+enc_f32(cbor_coder *d, u32int v, int justsize)
 {
-	u32int v;
 	uchar *p;
 
 	if(justsize)
@@ -203,8 +631,6 @@ enc_f(cbor_coder *d, cbor *c, int justsize)
 		return 0;
 
 	*p++ = 0xfa;
-
-	memcpy(&v, &c->f, 4);
 	*p++ = v >> 24;
 	*p++ = v >> 16;
 	*p++ = v >> 8;
@@ -213,12 +639,45 @@ enc_f(cbor_coder *d, cbor *c, int justsize)
 	return 5;
 }
 
+static ulong
+enc_real(cbor_coder *d, double v, int justsize)
+{
+	int n;
+	uchar *p;
+
+	n = cbor_floatlen(v);
+	if(justsize)
+		return n;
+
+	p = cbor_take(d, n);
+	if(p == nil)
+		return 0;
+
+	return cbor_putfloat(p, v);
+}
+
+static ulong
+enc_f(cbor_coder *d, cbor *c, int justsize)
+{
+	u32int v;
+
+	if(shortfloats(d))
+		return enc_real(d, c->f, justsize);
+
+	memcpy(&v, &c->f, 4);
+
+	return enc_f32(d, v, justsize);
+}
+
 static ulong
 enc_d(cbor_coder *d, cbor *c, int justsize)
 {
 	u64int v;
 	uchar *p;
 
+	if(shortfloats(d))
+		return enc_real(d, c->d, justsize);
+
 	if(justsize)
 		return 9;
 
@@ -228,7 +687,7 @@ enc_d(cbor_coder *d, cbor *c, int justsize)
 
 	*p++ = 0xfb;
 
-	memcpy(&v, &c->f, 8);
+	memcpy(&v, &c->d, 8);
 	*p++ = v >> 56;
 	*p++ = v >> 48;
 	*p++ = v >> 40;
@@ -253,6 +712,7 @@ static encfun encfuns[] = {
 [CBOR_NULL]			enc_null,
 [CBOR_FLOAT]		enc_f,
 [CBOR_DOUBLE]		enc_d,
+[CBOR_RAW]			enc_raw,
 };
 
 static ulong
@@ -285,4 +745,202 @@ ulong
 cbor_encode_size(cbor *c)
 {
 	return cbor_enc(nil, c, 1);
-}
\ No newline at end of file
+}
+
+/*
+ * like cbor_encode_size, but the sizes of arrays and maps are
+ * kept in them, so sizing an unchanged tree again costs only its
+ * root. appending to an array or map forgets its size, but not
+ * those of the containers above it, and nothing sees a change
+ * made in place: after changing anything below the root,
+ * cbor_touch each container on the path down to it.
+ */
+ulong
+cbor_encode_size_cached(cbor *c)
+{
+	cbor_coder d = {
+		.flags = CBOR_ENC_CACHE,
+	};
+
+	return cbor_enc(&d, c, 1);
+}
+
+/* forget the encoded size kept in c */
+void
+cbor_touch(cbor *c)
+{
+	c->flags &= ~CBOR_FLAG_SIZED;
+}
+
+/* make room for want more bytes of output in d */
+int
+cbor_grow(cbor_coder *d, long want)
+{
+	ulong used, cap, ncap;
+	uchar *p;
+	cbor_allocator *a;
+
+	a = d->alloc;
+	used = d->p - d->s;
+	cap = d->e - d->s;
+
+	ncap = cap * 2;
+	if(ncap < used + want)
+		ncap = used + want;
+	if(ncap < 64)
+		ncap = 64;
+
+	if(d->own)
+		p = a->realloc(a->context, d->s, cap, ncap);
+	else {
+		/* the caller's storage is left as it is */
+		p = a->alloc(a->context, ncap);
+		if(p != nil && used > 0)
+			memmove(p, d->s, used);
+	}
+	if(p == nil)
+		return -1;
+
+	d->s = p;
+	d->p = p + used;
+	d->e = p + ncap;
+	d->own = 1;
+
+	return 0;
+}
+
+static uchar*
+enc_grown(cbor_allocator *alloc, cbor *c, uchar *buf, ulong n, int flags, ulong *len)
+{
+	cbor_coder d = {
+		.alloc = alloc,
+		.flags = flags,
+		.s = buf,
+		.p = buf,
+		.e = buf + n,
+		.grow = 1,
+	};
+
+	*len = cbor_enc(&d, c, 0);
+	if(*len == 0){
+		if(d.own)
+			alloc->free(alloc->context, d.s);
+		return nil;
+	}
+
+	return d.s;
+}
+
+/*
+ * encode c in one pass into a buffer that grows as it fills.
+ * buf[0:n], which may be nil, is where it starts; if that is
+ * outgrown, the buffer moves to one from alloc, which the
+ * caller frees. returns the buffer, with its length in *len,
+ * or nil on error.
+ */
+uchar*
+cbor_encode_alloc(cbor_allocator *alloc, cbor *c, uchar *buf, ulong n, ulong *len)
+{
+	return enc_grown(alloc, c, buf, n, 0, len);
+}
+
+/*
+ * encode c as a list of segments, to be written out in order.
+ * headers and short items are packed into buf[0:n]; byte and
+ * text strings, and lazy arrays and maps, of min bytes or more
+ * are not copied but referenced where they are, so they must
+ * not change until the segments are written. returns the number
+ * of segments put in seg[0:nseg], or -1 if buf or seg is too
+ * small.
+ */
+int
+cbor_encode_segs(cbor *c, uchar *buf, ulong n, cbor_seg *seg, int nseg, ulong min)
+{
+	cbor_coder d = {
+		.alloc = nil,
+		.s = buf,
+		.p = buf,
+		.e = buf + n,
+		.seg = seg,
+		.maxseg = nseg,
+		.segmin = min,
+		.mark = buf,
+	};
+
+	if(cbor_enc(&d, c, 0) == 0)
+		return -1;
+
+	if(d.p > d.mark && enc_seg(&d, d.mark, d.p - d.mark) < 0)
+		return -1;
+
+	return d.nseg;
+}
+
+/*
+ * like cbor_encode_alloc, but in the deterministic form of RFC 8949
+ * 4.2.1, so equal trees encode to equal bytes: arguments and
+ * floats as short as they can be, definite lengths, and map keys
+ * sorted by their encodings. lazy arrays and maps in c are
+ * expanded. a map with two equal keys, or a CBOR_RAW node, is
+ * an error.
+ */
+uchar*
+cbor_encode_canonical(cbor_allocator *alloc, cbor *c, uchar *buf, ulong n, ulong *len)
+{
+	return enc_grown(alloc, c, buf, n, CBOR_ENC_CANON|CBOR_ENC_SHORT, len);
+}
+
+/*
+ * like cbor_encode_alloc, but with each float, single or double,
+ * in the shortest of half, single and double precision that
+ * holds it exactly: RFC 8949's preferred serialization.
+ */
+uchar*
+cbor_encode_preferred(cbor_allocator *alloc, cbor *c, uchar *buf, ulong n, ulong *len)
+{
+	return enc_grown(alloc, c, buf, n, CBOR_ENC_SHORT, len);
+}
+
+/*
+ * begin an indefinite-length item of type CBOR_BYTE, CBOR_STRING,
+ * CBOR_ARRAY or CBOR_MAP, for when its length is not known up
+ * front. encode its chunks, elements or keys and values after it,
+ * then end it with cbor_encode_break.
+ */
+ulong
+cbor_encode_indefinite(int type, uchar *buf, ulong n)
+{
+	uchar major;
+	cbor_coder d = {
+		.alloc = nil,
+		.s = buf,
+		.p = buf,
+		.e = buf + n,
+	};
+
+	switch(type){
+	default:
+		werrstr("type %d has no indefinite length", type);
+		return 0;
+
+	case CBOR_BYTE:		major = 2<<5; break;
+	case CBOR_STRING:	major = 3<<5; break;
+	case CBOR_ARRAY:	major = 4<<5; break;
+	case CBOR_MAP:		major = 5<<5; break;
+	}
+
+	return enc_op(&d, major | 31, 0);
+}
+
+ulong
+cbor_encode_break(uchar *buf, ulong n)
+{
+	cbor_coder d = {
+		.alloc = nil,
+		.s = buf,
+		.p = buf,
+		.e = buf + n,
+	};
+
+	return enc_op(&d, 0xff, 0);
+}
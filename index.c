@@ -0,0 +1,137 @@
+#include <u.h>
+#include <libc.h>
+
+#include "cbor.h"
+#include "cborimpl.h"
+
+/*
+ * a map's key index is a hash table kept in the same block as
+ * its elements, after the last one, so it is freed along with
+ * them. each slot holds the number of an element whose key is
+ * a definite-length text string, counting from 1; 0 is empty.
+ * the table is sized by the number of elements, and is lost
+ * when cbor_map_append_element replaces the block.
+ */
+
+/* slots in the index of a map of n elements, at most half full */
+static ulong
+idx_cap(ulong n)
+{
+	ulong cap;
+
+	for(cap = 8; cap < 2*n; cap *= 2)
+		;
+
+	return cap;
+}
+
+static u32int*
+idx_tab(cbor *map)
+{
+	return (u32int*)(map->array + map->len);
+}
+
+static int
+idx_key(cbor *k, char *key, int n)
+{
+	return k->type == CBOR_STRING && (k->flags & CBOR_FLAG_INDEFINITE) == 0
+		&& k->len == n && memcmp(k->string, key, n) == 0;
+}
+
+/*
+ * index the text keys of map, so cbor_map_get finds them without
+ * a scan. an index already there is rebuilt, as it must be after
+ * keys are changed in place. of equal keys, the first is found.
+ * the elements are reallocated from a, so map must not be in a
+ * cbor_decode_flat tree, whose nodes share one block; only the
+ * root of one is marked, and refused.
+ */
+int
+cbor_map_index(cbor_allocator *a, cbor *map)
+{
+	ulong i, j, cap, osz;
+	u32int h, *tab;
+	cbor **na, *k;
+
+	if(map->type != CBOR_MAP){
+		werrstr("not a map");
+		return -1;
+	}
+
+	if(map->flags & CBOR_FLAG_FLAT){
+		werrstr("cannot index a flat tree");
+		return -1;
+	}
+
+	if(cbor_expand(a, map) < 0)
+		return -1;
+
+	cap = idx_cap(map->len);
+
+	osz = map->len * sizeof(cbor*);
+	if(map->flags & CBOR_FLAG_INDEXED)
+		osz += cap * sizeof(u32int);
+
+	na = a->realloc(a->context, map->array, osz, map->len * sizeof(cbor*) + cap * sizeof(u32int));
+	if(na == nil)
+		return -1;
+
+	map->array = na;
+	map->flags |= CBOR_FLAG_INDEXED;
+
+	tab = idx_tab(map);
+	memset(tab, 0, cap * sizeof(u32int));
+
+	for(i = 0; i < map->len; i++){
+		k = map->array[i]->key;
+		if(k->type != CBOR_STRING || (k->flags & CBOR_FLAG_INDEFINITE) != 0)
+			continue;
+
+		h = cbor_hash(k->string, k->len);
+		for(j = h & (cap-1); tab[j] != 0; j = (j+1) & (cap-1))
+			if(idx_key(map->array[tab[j]-1]->key, k->string, k->len))
+				break;
+
+		if(tab[j] == 0)
+			tab[j] = i+1;
+	}
+
+	return 0;
+}
+
+/*
+ * the value of the text key key[0:n] in map, or nil if there is
+ * none. keys must match whole. map must not be lazy.
+ */
+cbor*
+cbor_map_get(cbor *map, char *key, int n)
+{
+	ulong i, cap;
+	u32int *tab;
+	cbor *e;
+
+	if(map->type != CBOR_MAP || (map->flags & CBOR_FLAG_LAZY) != 0){
+		werrstr("not an expanded map");
+		return nil;
+	}
+
+	if(map->flags & CBOR_FLAG_INDEXED){
+		cap = idx_cap(map->len);
+		tab = idx_tab(map);
+
+		for(i = cbor_hash(key, n) & (cap-1); tab[i] != 0; i = (i+1) & (cap-1)){
+			e = map->array[tab[i]-1];
+			if(idx_key(e->key, key, n))
+				return e->value;
+		}
+	} else {
+		for(i = 0; i < map->len; i++){
+			e = map->array[i];
+			if(idx_key(e->key, key, n))
+				return e->value;
+		}
+	}
+
+	werrstr("%.*s: not found", n, key);
+	return nil;
+}
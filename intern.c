@@ -0,0 +1,213 @@
+#include <u.h>
+#include <libc.h>
+
+#include "cbor.h"
+#include "cborimpl.h"
+
+/*
+ * an intern table keeps one copy of each short string it is
+ * given, so equal strings share their bytes. the copies are
+ * packed into blocks and live until the table is freed.
+ */
+
+typedef struct istr istr;
+typedef struct iblock iblock;
+
+struct istr {
+	char	*s;
+	int	len;
+	u32int	hash;
+};
+
+struct iblock {
+	iblock	*next;
+	char	*p, *e;	/* free space, following the header */
+};
+
+struct cbor_intern {
+	cbor_allocator	*alloc;
+	int	maxlen;	/* longest string taken */
+	ulong	max;	/* most strings held, or 0 */
+	ulong	n;
+	ulong	cap;	/* slots in tab, a power of two */
+	istr	*tab;
+	iblock	*blk;	/* newest first */
+};
+
+enum {
+	IBLOCK	= 4096,
+	ISLOTS	= 64,
+};
+
+/* FNV-1a, for this table and the map index */
+u32int
+cbor_hash(char *s, int n)
+{
+	u32int h;
+
+	h = 2166136261U;
+	while(n-- > 0){
+		h ^= (uchar)*s++;
+		h *= 16777619U;
+	}
+
+	return h;
+}
+
+cbor_intern*
+cbor_intern_new(cbor_allocator *alloc, int maxlen, ulong max)
+{
+	cbor_intern *t;
+
+	if(maxlen < 0 || maxlen > IBLOCK - 1){
+		werrstr("bad intern length %d", maxlen);
+		return nil;
+	}
+
+	t = alloc->alloc(alloc->context, sizeof(*t));
+	if(t == nil)
+		return nil;
+
+	t->tab = alloc->alloc(alloc->context, ISLOTS * sizeof(istr));
+	if(t->tab == nil){
+		alloc->free(alloc->context, t);
+		return nil;
+	}
+
+	memset(t->tab, 0, ISLOTS * sizeof(istr));
+	t->alloc = alloc;
+	t->maxlen = maxlen;
+	t->max = max;
+	t->n = 0;
+	t->cap = ISLOTS;
+	t->blk = nil;
+
+	return t;
+}
+
+void
+cbor_intern_free(cbor_intern *t)
+{
+	iblock *b;
+	cbor_allocator *a;
+
+	if(t == nil)
+		return;
+
+	a = t->alloc;
+	while((b = t->blk) != nil){
+		t->blk = b->next;
+		a->free(a->context, b);
+	}
+
+	a->free(a->context, t->tab);
+	a->free(a->context, t);
+}
+
+/* double the slots */
+static int
+igrow(cbor_intern *t)
+{
+	ulong i, j, cap;
+	istr *tab;
+	cbor_allocator *a;
+
+	a = t->alloc;
+	cap = t->cap * 2;
+
+	tab = a->alloc(a->context, cap * sizeof(istr));
+	if(tab == nil)
+		return -1;
+	memset(tab, 0, cap * sizeof(istr));
+
+	for(i = 0; i < t->cap; i++){
+		if(t->tab[i].s == nil)
+			continue;
+		for(j = t->tab[i].hash & (cap-1); tab[j].s != nil; j = (j+1) & (cap-1))
+			;
+		tab[j] = t->tab[i];
+	}
+
+	a->free(a->context, t->tab);
+	t->tab = tab;
+	t->cap = cap;
+
+	return 0;
+}
+
+/* a NUL-terminated copy of s[0:n] in the blocks */
+static char*
+istore(cbor_intern *t, char *s, int n)
+{
+	char *p;
+	iblock *b;
+	cbor_allocator *a;
+
+	b = t->blk;
+	if(b == nil || b->e - b->p < n+1){
+		a = t->alloc;
+		b = a->alloc(a->context, sizeof(iblock) + IBLOCK);
+		if(b == nil)
+			return nil;
+
+		b->p = (char*)(b+1);
+		b->e = b->p + IBLOCK;
+		b->next = t->blk;
+		t->blk = b;
+	}
+
+	p = b->p;
+	memmove(p, s, n);
+	p[n] = '\0';
+	b->p += n+1;
+
+	return p;
+}
+
+/*
+ * the table's copy of s[0:n], made on first sight. the copy is
+ * NUL-terminated. returns nil if s is longer than the table's
+ * maxlen or the table already holds max strings.
+ */
+char*
+cbor_intern_str(cbor_intern *t, char *s, int n)
+{
+	ulong i;
+	u32int h;
+	istr *e;
+
+	if(n > t->maxlen){
+		werrstr("string too long to intern");
+		return nil;
+	}
+
+	h = cbor_hash(s, n);
+	for(i = h & (t->cap-1); t->tab[i].s != nil; i = (i+1) & (t->cap-1)){
+		e = &t->tab[i];
+		if(e->hash == h && e->len == n && memcmp(e->s, s, n) == 0)
+			return e->s;
+	}
+
+	if(t->max != 0 && t->n >= t->max){
+		werrstr("intern table full");
+		return nil;
+	}
+
+	/* keep the table under three quarters full */
+	if((t->n+1) * 4 > t->cap * 3){
+		if(igrow(t) < 0)
+			return nil;
+		for(i = h & (t->cap-1); t->tab[i].s != nil; i = (i+1) & (t->cap-1))
+			;
+	}
+
+	e = &t->tab[i];
+	e->s = istore(t, s, n);
+	if(e->s == nil)
+		return nil;
+	e->len = n;
+	e->hash = h;
+	t->n++;
+
+	return e->s;
+}
@@ -0,0 +1,213 @@
+#include <u.h>
+#include <libc.h>
+
+#include "cbor.h"
+#include "cborimpl.h"
+
+/*
+ * decode the item at p, leaving arrays and maps lazy, and set
+ * *next past it if next is not nil. tags are decoded down to
+ * what they wrap, no deeper than the eager decoder goes.
+ */
+static cbor*
+lazy_item(cbor_allocator *a, uchar *p, uchar *e, uchar **next)
+{
+	int ntag;
+	uchar *q;
+	cbor *c, *root, **slot;
+	cbor_hdr h;
+
+	root = nil;
+	slot = &root;
+	ntag = 0;
+
+	for(;;){
+		q = cbor_head(p, e, &h);
+		if(q == nil)
+			goto fail;
+
+		if(h.major != 6)
+			break;
+
+		if(++ntag > CBOR_MAXDEPTH){
+			werrstr("nesting deeper than %d", CBOR_MAXDEPTH);
+			goto fail;
+		}
+
+		c = cbor_make_tag(a, h.arg, nil);
+		if(c == nil)
+			goto fail;
+
+		*slot = c;
+		slot = &c->item;
+		p = q;
+	}
+
+	q = e;
+	if(next != nil || (h.major != 4 && h.major != 5)){
+		q = cbor_skipn(p, e, 1);
+		if(q == nil)
+			goto fail;
+	}
+
+	if(h.major == 4 || h.major == 5){
+		c = a->alloc(a->context, sizeof(*c));
+		if(c == nil)
+			goto fail;
+
+		c->type = h.major == 4 ? CBOR_ARRAY : CBOR_MAP;
+		c->flags = CBOR_FLAG_LAZY;
+		if((h.op & 0x1f) == 31)
+			c->flags |= CBOR_FLAG_INDEFINITE;
+		c->enc = p;
+		c->ence = e;
+	} else {
+		c = cbor_decode_borrow(a, p, q - p);
+		if(c == nil)
+			goto fail;
+	}
+
+	*slot = c;
+	if(next != nil)
+		*next = q;
+
+	return root;
+
+fail:
+	cbor_free(a, root);
+	return nil;
+}
+
+/*
+ * decode only the top of the item in buf. arrays and maps keep
+ * their encoded bytes and decode one level at a time, the first
+ * time cbor_expand or cbor_index reaches them; strings point
+ * into buf. buf must stay valid until the tree is freed, and
+ * errors in the parts not read yet are found on expansion.
+ */
+cbor*
+cbor_decode_lazy(cbor_allocator *alloc, uchar *buf, ulong n)
+{
+	return lazy_item(alloc, buf, buf + n, nil);
+}
+
+/*
+ * decode the children of a lazy array or map, which are lazy in
+ * turn. afterwards c is an ordinary array or map. on failure c
+ * is left as it was.
+ */
+int
+cbor_expand(cbor_allocator *a, cbor *c)
+{
+	uchar *p, *e;
+	u64int i, n, cap;
+	cbor **arr, **na, *k, *v;
+	cbor_hdr h;
+
+	if((c->flags & CBOR_FLAG_LAZY) == 0)
+		return 0;
+
+	e = c->ence;
+	p = cbor_head(c->enc, e, &h);
+	if(p == nil)
+		return -1;
+
+	if((h.op & 0x1f) == 31){
+		n = INDEF;
+		cap = 8;
+	} else {
+		if(h.arg > (e - p) / (c->type == CBOR_MAP ? 2 : 1)){
+			werrstr("length exceeds input");
+			return -1;
+		}
+
+		n = h.arg;
+		cap = n;
+	}
+
+	arr = a->alloc(a->context, cap * sizeof(cbor*));
+	if(arr == nil && cap > 0)
+		return -1;
+
+	for(i = 0; i < n; i++){
+		if(n == INDEF){
+			if(p < e && *p == 0xff){
+				p++;
+				break;
+			}
+
+			if(i == cap){
+				na = a->realloc(a->context, arr, cap * sizeof(cbor*), cap * 2 * sizeof(cbor*));
+				if(na == nil)
+					goto fail;
+				arr = na;
+				cap *= 2;
+			}
+		}
+
+		k = lazy_item(a, p, e, &p);
+		if(k == nil)
+			goto fail;
+
+		if(c->type == CBOR_ARRAY){
+			arr[i] = k;
+			continue;
+		}
+
+		v = lazy_item(a, p, e, &p);
+		if(v == nil){
+			cbor_free(a, k);
+			goto fail;
+		}
+
+		arr[i] = cbor_make_map_element(a, k, v);
+		if(arr[i] == nil){
+			cbor_free(a, k);
+			cbor_free(a, v);
+			goto fail;
+		}
+	}
+
+	/* trim the slots grown ahead */
+	if(i > 0 && i < cap){
+		na = a->realloc(a->context, arr, cap * sizeof(cbor*), i * sizeof(cbor*));
+		if(na != nil)
+			arr = na;
+	}
+
+	c->flags &= ~CBOR_FLAG_LAZY;
+	c->array = arr;
+	c->len = i;
+
+	return 0;
+
+fail:
+	while(i > 0)
+		cbor_free(a, arr[--i]);
+	a->free(a->context, arr);
+
+	return -1;
+}
+
+/*
+ * child i of an array or map, expanding it first if it is lazy.
+ * the children of a map are its CBOR_MAP_ELEMENTs.
+ */
+cbor*
+cbor_index(cbor_allocator *a, cbor *c, int i)
+{
+	if(c->type != CBOR_ARRAY && c->type != CBOR_MAP){
+		werrstr("not an array or map");
+		return nil;
+	}
+
+	if(cbor_expand(a, c) < 0)
+		return nil;
+
+	if(i < 0 || i >= c->len){
+		werrstr("index %d out of range", i);
+		return nil;
+	}
+
+	return c->array[i];
+}
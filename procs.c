@@ -0,0 +1,149 @@
+#include <u.h>
+#include <libc.h>
+
+#include "cbor.h"
+
+typedef struct work work;
+struct work {
+	cbor_allocator	*alloc;
+	uchar	*buf;
+	cbor_span	*span;
+	cbor	**item;
+	long	lo, hi;	/* items decoded by this proc */
+
+	long	bad;	/* item that failed, or -1 */
+	char	err[ERRMAX];
+
+	long	*done;	/* released when the proc is finished */
+	long	sem;	/* ws[0].sem is what done points at */
+};
+
+static void
+decwork(work *w)
+{
+	long i;
+
+	w->bad = -1;
+
+	for(i = w->lo; i < w->hi; i++){
+		w->item[i] = cbor_decode(w->alloc, w->buf + w->span[i].off, w->span[i].len);
+		if(w->item[i] == nil){
+			w->bad = i;
+			rerrstr(w->err, sizeof(w->err));
+			break;
+		}
+	}
+
+	/* a proc cleans up after itself, with its own allocator */
+	if(w->bad >= 0)
+		while(i > w->lo)
+			cbor_free(w->alloc, w->item[--i]);
+}
+
+/*
+ * decode the items of the RFC 8742 sequence in buf with up to
+ * nproc procs sharing memory. the item boundaries are found with
+ * cbor_seq_split into span; then each proc decodes a run of
+ * consecutive items, about the same number of bytes each, with
+ * its own allocator: proc i uses alloc[i], so the allocators
+ * need not be shared between procs. up to nitem items are
+ * decoded into item in their original order, and who[k], unless
+ * who is nil, is the proc and so the allocator that item[k]
+ * belongs to.
+ *
+ * returns the number of items, which like cbor_seq_split stops
+ * short of n at a truncated or malformed item. if any item
+ * fails to decode, nothing is kept and -1 is returned.
+ */
+long
+cbor_decode_procs(cbor_allocator *alloc, int nproc, uchar *buf, ulong n,
+	cbor_span *span, cbor **item, int *who, long nitem)
+{
+	int i, nw, spawned;
+	long k, nspan, bad;
+	uvlong total, sum;
+	work *ws, *w;
+
+	nspan = cbor_seq_split(buf, n, span, nitem);
+	if(nspan == 0)
+		return 0;
+
+	if(nproc < 1)
+		nproc = 1;
+	if(nproc > nspan)
+		nproc = nspan;
+
+	ws = alloc[0].alloc(alloc[0].context, nproc * sizeof(work));
+	if(ws == nil)
+		return -1;
+
+	total = span[nspan-1].off + span[nspan-1].len - span[0].off;
+
+	/* the procs do not share the caller's stack; the semaphore is in ws */
+	ws[0].sem = 0;
+
+	/* cut the items into runs of about total/nproc bytes */
+	k = 0;
+	sum = 0;
+	for(nw = 0; nw < nproc && k < nspan; nw++){
+		w = &ws[nw];
+		w->alloc = &alloc[nw];
+		w->buf = buf;
+		w->span = span;
+		w->item = item;
+		w->done = &ws[0].sem;
+		w->lo = k;
+
+		do
+			sum += span[k++].len;
+		while(k < nspan && (nw == nproc-1 || sum < total * (nw+1) / nproc));
+
+		w->hi = k;
+	}
+
+	/* the caller takes the first run; if a proc cannot be made, it takes that one too */
+	spawned = 0;
+	for(i = 1; i < nw; i++){
+		switch(rfork(RFPROC|RFMEM|RFNOWAIT)){
+		case -1:
+			decwork(&ws[i]);
+			break;
+		case 0:
+			decwork(&ws[i]);
+			semrelease(ws[i].done, 1);
+			_exits(nil);
+		default:
+			spawned++;
+		}
+	}
+
+	decwork(&ws[0]);
+
+	while(spawned > 0)
+		if(semacquire(&ws[0].sem, 1) == 1)
+			spawned--;
+
+	bad = -1;
+	for(i = 0; i < nw; i++){
+		if(ws[i].bad >= 0 && bad < 0){
+			bad = i;
+			werrstr("item %ld: %s", ws[i].bad, ws[i].err);
+		}
+
+		if(who != nil)
+			for(k = ws[i].lo; k < ws[i].hi; k++)
+				who[k] = i;
+	}
+
+	if(bad >= 0){
+		for(i = 0; i < nw; i++)
+			if(ws[i].bad < 0)
+				for(k = ws[i].lo; k < ws[i].hi; k++)
+					cbor_free(&alloc[i], item[k]);
+		nspan = -1;
+	}
+
+	alloc[0].free(alloc[0].context, ws);
+
+	return nspan;
+}
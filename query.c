@@ -0,0 +1,174 @@
+#include <u.h>
+#include <libc.h>
+
+#include "cbor.h"
+
+/* move past tags to what they wrap */
+static int
+untag(cbor_cursor *cur)
+{
+	int rv;
+	cbor_cursor sub;
+
+	while(cur->type == CBOR_TAG){
+		if(cbor_enter(cur, &sub) < 0)
+			return -1;
+
+		rv = cbor_next(&sub);
+		if(rv == 0)
+			werrstr("tag without item");
+		if(rv <= 0)
+			return -1;
+
+		*cur = sub;
+	}
+
+	return 0;
+}
+
+/* find the value of key[0:n] in the map at cur */
+static int
+q_key(cbor_cursor *cur, char *key, int n)
+{
+	int rv;
+	cbor_cursor sub;
+
+	if(cur->type != CBOR_MAP){
+		werrstr("%.*s: not a map", n, key);
+		return 0;
+	}
+
+	if(cbor_enter(cur, &sub) < 0)
+		return -1;
+
+	for(;;){
+		rv = cbor_next(&sub);
+		if(rv <= 0)
+			break;
+
+		/* only definite-length text keys are compared */
+		if(sub.type == CBOR_STRING && sub.flags == 0
+		&& sub.len == n && memcmp(sub.byte, key, n) == 0){
+			rv = cbor_next(&sub);
+			if(rv == 0){
+				werrstr("map key without value");
+				rv = -1;
+			}
+			break;
+		}
+
+		rv = cbor_next(&sub);
+		if(rv == 0)
+			werrstr("map key without value");
+		if(rv <= 0)
+			return -1;
+	}
+
+	if(rv == 0)
+		werrstr("%.*s: not found", n, key);
+	if(rv == 1)
+		*cur = sub;
+
+	return rv;
+}
+
+/* find element i of the array at cur */
+static int
+q_index(cbor_cursor *cur, ulong i)
+{
+	int rv;
+	cbor_cursor sub;
+
+	if(cur->type != CBOR_ARRAY){
+		werrstr("[%lud]: not an array", i);
+		return 0;
+	}
+
+	if(cbor_enter(cur, &sub) < 0)
+		return -1;
+
+	/* the elements before i are skipped whole */
+	if(i > 0 && (cur->flags & CBOR_FLAG_INDEFINITE) == 0){
+		if(i >= cur->len){
+			werrstr("[%lud]: out of range", i);
+			return 0;
+		}
+
+		sub.p = cbor_skip(sub.p, sub.e - sub.p, i);
+		if(sub.p == nil)
+			return -1;
+		sub.left -= i;
+		i = 0;
+	}
+
+	for(;;){
+		rv = cbor_next(&sub);
+		if(rv <= 0 || i-- == 0)
+			break;
+	}
+
+	if(rv == 0)
+		werrstr("out of range");
+	if(rv == 1)
+		*cur = sub;
+
+	return rv;
+}
+
+/*
+ * find the item at path in the encoded item in buf, reading
+ * only the bytes before it. a path is a list of map keys
+ * separated by dots, each optionally followed by array indices
+ * in brackets, as in "state.peers[17].addr"; the empty path is
+ * the item itself. tags on the way are looked through.
+ *
+ * returns 1 with the item in cur, as left by cbor_next, 0 if it
+ * is not there, and -1 on malformed input or path.
+ */
+int
+cbor_query(uchar *buf, ulong n, char *path, cbor_cursor *cur)
+{
+	int rv;
+	char *s, *end;
+	ulong i;
+
+	cbor_cursor_init(cur, buf, n);
+	rv = cbor_next(cur);
+	if(rv == 0)
+		werrstr("no item");
+	if(rv <= 0)
+		return rv;
+
+	s = path;
+	while(*s != '\0'){
+		if(untag(cur) < 0)
+			return -1;
+
+		if(*s == '['){
+			i = strtoul(s+1, &end, 10);
+			if(end == s+1 || *end != ']'){
+				werrstr("bad index in path: %s", s);
+				return -1;
+			}
+			s = end+1;
+
+			rv = q_index(cur, i);
+		} else {
+			if(s != path){
+				if(*s++ != '.'){
+					werrstr("bad path: %s", s-1);
+					return -1;
+				}
+			}
+
+			end = s + strcspn(s, ".[");
+			rv = q_key(cur, s, end - s);
+			s = end;
+		}
+
+		if(rv <= 0)
+			return rv;
+	}
+
+	return 1;
+}
@@ -0,0 +1,285 @@
+#include <u.h>
+#include <libc.h>
+
+#include "cbor.h"
+
+static int field(cbor_cursor *cur, cbor_field *f, uchar *v);
+
+static int
+putuint(uchar *p, int size, u64int u)
+{
+	if(size < 8 && (u >> 8*size) != 0){
+		werrstr("%llud out of range", u);
+		return -1;
+	}
+
+	switch(size){
+	default:
+		werrstr("bad field size %d", size);
+		return -1;
+	case 1:
+		*p = u;
+		break;
+	case 2:
+		*(u16int*)p = u;
+		break;
+	case 4:
+		*(u32int*)p = u;
+		break;
+	case 8:
+		*(u64int*)p = u;
+		break;
+	}
+
+	return 0;
+}
+
+static int
+putint(uchar *p, int size, s64int i)
+{
+	s64int lim;
+
+	if(size < 8){
+		lim = 1LL << (8*size - 1);
+		if(i < -lim || i >= lim){
+			werrstr("%lld out of range", i);
+			return -1;
+		}
+	}
+
+	switch(size){
+	default:
+		werrstr("bad field size %d", size);
+		return -1;
+	case 1:
+		*(schar*)p = i;
+		break;
+	case 2:
+		*(short*)p = i;
+		break;
+	case 4:
+		*(int*)p = i;
+		break;
+	case 8:
+		*(vlong*)p = i;
+		break;
+	}
+
+	return 0;
+}
+
+/* the fields of the struct at v, from the array or map at cur */
+static int
+fields(cbor_cursor *cur, cbor_field *f, uchar *v)
+{
+	int i, n, rv;
+	cbor_field *k;
+	cbor_cursor sub;
+
+	if(cbor_enter(cur, &sub) < 0)
+		return -1;
+
+	if(f->type == CBOR_ARRAY){
+		/* elements past the last field are skipped */
+		for(i = 0; i < f->nsub; i++){
+			rv = field(&sub, &f->sub[i], v);
+			if(rv == 0)
+				werrstr("array has %d of %d fields", i, f->nsub);
+			if(rv <= 0)
+				return -1;
+		}
+	} else {
+		/* as are keys without a field */
+		for(;;){
+			rv = cbor_next(&sub);
+			if(rv <= 0)
+				break;
+
+			k = nil;
+			if(sub.type == CBOR_STRING && sub.flags == 0){
+				for(i = 0; i < f->nsub; i++){
+					n = f->sub[i].key != nil ? strlen(f->sub[i].key) : -1;
+					if(n == sub.len && memcmp(f->sub[i].key, sub.byte, n) == 0){
+						k = &f->sub[i];
+						break;
+					}
+				}
+			}
+
+			if(k != nil)
+				rv = field(&sub, k, v);
+			else
+				rv = cbor_next(&sub);
+			if(rv == 0)
+				werrstr("map key without value");
+			if(rv <= 0)
+				return -1;
+		}
+
+		if(rv < 0)
+			return -1;
+	}
+
+	return cbor_leave(cur, &sub);
+}
+
+/*
+ * store the item at cur in the field at p of the struct at v.
+ * a byte string's length and the number of repeated elements go
+ * in the struct; a tagged item is another field of it.
+ */
+static int
+item(cbor_cursor *cur, cbor_field *f, uchar *v, uchar *p)
+{
+	int rv;
+	char *s;
+	cbor_cursor sub;
+
+	if(cur->type != f->type && !(f->type == CBOR_NINT && cur->type == CBOR_UINT)
+	&& !((f->type == CBOR_FLOAT || f->type == CBOR_DOUBLE) && (cur->type == CBOR_FLOAT || cur->type == CBOR_DOUBLE))){
+		werrstr("%s: type %d, want %d", f->key != nil ? f->key : "field", cur->type, f->type);
+		return -1;
+	}
+
+	switch(f->type){
+	default:
+		werrstr("bad field type %d", f->type);
+		return -1;
+
+	case CBOR_UINT:
+		return putuint(p, f->size, cur->uint);
+
+	case CBOR_NINT:
+		if(cur->uint > (1ULL<<63)-1){
+			werrstr("integer out of range");
+			return -1;
+		}
+
+		if(cur->type == CBOR_UINT)
+			return putint(p, f->size, cur->uint);
+
+		return putint(p, f->size, -1 - (s64int)cur->uint);
+
+	case CBOR_BYTE:
+	case CBOR_STRING:
+		if(cur->flags & CBOR_FLAG_INDEFINITE){
+			werrstr("indefinite-length string");
+			return -1;
+		}
+
+		if(f->type == CBOR_BYTE){
+			*(uchar**)p = cur->byte;
+			return putuint(v + f->lenoff, f->lensize, cur->len);
+		}
+
+		/* NUL-terminated in place, over the end of its header */
+		s = (char*)cur->byte - 1;
+		memmove(s, cur->byte, cur->len);
+		s[cur->len] = '\0';
+		*(char**)p = s;
+		return 0;
+
+	case CBOR_FLOAT:
+	case CBOR_DOUBLE:
+		if(f->size == sizeof(float))
+			*(float*)p = cur->type == CBOR_FLOAT ? cur->f : cur->d;
+		else
+			*(double*)p = cur->type == CBOR_FLOAT ? cur->f : cur->d;
+		return 0;
+
+	case CBOR_NULL:
+		return 0;
+
+	case CBOR_ARRAY:
+	case CBOR_MAP:
+		return fields(cur, f, p);
+
+	case CBOR_TAG:
+		if(putuint(p, f->size, cur->uint) < 0 || cbor_enter(cur, &sub) < 0)
+			return -1;
+
+		rv = field(&sub, f->sub, v);
+		if(rv == 0)
+			werrstr("tag without item");
+		if(rv <= 0)
+			return -1;
+
+		return cbor_leave(cur, &sub);
+	}
+}
+
+/* the next item at cur into the field f of the struct at v */
+static int
+field(cbor_cursor *cur, cbor_field *f, uchar *v)
+{
+	int i, rv;
+	cbor_cursor sub;
+
+	rv = cbor_next(cur);
+	if(rv <= 0)
+		return rv;
+
+	if((f->flags & CBOR_FIELD_REPEAT) == 0)
+		return item(cur, f, v, v + f->off) < 0 ? -1 : 1;
+
+	if(cur->type != CBOR_ARRAY){
+		werrstr("%s: type %d, want array", f->key != nil ? f->key : "field", cur->type);
+		return -1;
+	}
+
+	if(cbor_enter(cur, &sub) < 0)
+		return -1;
+
+	for(i = 0; ; i++){
+		rv = cbor_next(&sub);
+		if(rv < 0)
+			return -1;
+		if(rv == 0)
+			break;
+
+		if(i == f->max){
+			werrstr("more than %d elements", f->max);
+			return -1;
+		}
+
+		if(item(&sub, f, v, v + f->off + i*f->size) < 0)
+			return -1;
+	}
+
+	if(putuint(v + f->lenoff, f->lensize, i) < 0 || cbor_leave(cur, &sub) < 0)
+		return -1;
+
+	return 1;
+}
+
+/*
+ * decode the next item at cur straight into the struct at v, as
+ * described by f, without building a tree. text strings are
+ * NUL-terminated in place and byte strings point into the input,
+ * which is changed and must outlive v. fields whose keys are not
+ * in a map keep their values. returns 1, 0 at the end of the
+ * input, or -1 on error.
+ */
+int
+cbor_next_struct(cbor_cursor *cur, cbor_field *f, void *v)
+{
+	return field(cur, f, v);
+}
+
+/* as cbor_next_struct, for the item in buf; returns its length */
+long
+cbor_decode_struct(uchar *buf, ulong n, cbor_field *f, void *v)
+{
+	int rv;
+	cbor_cursor cur;
+
+	cbor_cursor_init(&cur, buf, n);
+
+	rv = field(&cur, f, v);
+	if(rv == 0)
+		werrstr("no item");
+	if(rv <= 0)
+		return -1;
+
+	return cur.p - buf;
+}
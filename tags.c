@@ -0,0 +1,112 @@
+#include <u.h>
+#include <libc.h>
+
+#include "cbor.h"
+
+/*
+ * hooks for cbor_decoder_hook that turn standard tags into plain
+ * values as they are decoded.
+ */
+
+/* epoch time (tag 1): the number of seconds, without the tag */
+cbor*
+cbor_hook_unixtime(cbor_allocator *a, u64int tag, cbor *item, void *arg)
+{
+	USED(a, tag, arg);
+
+	switch(item->type){
+	case CBOR_UINT:
+	case CBOR_NINT:
+	case CBOR_FLOAT:
+	case CBOR_DOUBLE:
+		return item;
+	}
+
+	werrstr("epoch time is not a number");
+	return nil;
+}
+
+/*
+ * bignums (tags 2 and 3) small enough for 64 bits become plain
+ * ints; larger ones keep their tag.
+ */
+cbor*
+cbor_hook_bignum(cbor_allocator *a, u64int tag, cbor *item, void *arg)
+{
+	ulong i;
+	u64int v;
+	cbor *c;
+
+	USED(arg);
+
+	if(item->type != CBOR_BYTE){
+		werrstr("bignum is not a byte string");
+		return nil;
+	}
+
+	if(item->flags & CBOR_FLAG_INDEFINITE)
+		return cbor_make_tag(a, tag, item);
+
+	for(i = 0; i < item->len && item->byte[i] == 0; i++)
+		;
+	if(item->len - i > 8)
+		return cbor_make_tag(a, tag, item);
+
+	v = 0;
+	for(; i < item->len; i++)
+		v = v<<8 | item->byte[i];
+
+	/* a negative bignum is -1-v, which is how a CBOR_NINT keeps it */
+	c = cbor_make_uint(a, v);
+	if(c == nil)
+		return nil;
+	if(tag == CBOR_TAG_NEGBIGNUM)
+		c->type = CBOR_NINT;
+
+	cbor_free(a, item);
+
+	return c;
+}
+
+/* a decimal fraction (tag 4) [e, m] becomes the double m*10^e */
+cbor*
+cbor_hook_decimal(cbor_allocator *a, u64int tag, cbor *item, void *arg)
+{
+	s64int e;
+	double m;
+	cbor *c;
+
+	USED(tag, arg);
+
+	if(item->type != CBOR_ARRAY || (item->flags & CBOR_FLAG_LAZY) != 0 || item->len != 2
+	|| cbor_int(item->array[0], &e) < 0){
+		werrstr("bad decimal fraction");
+		return nil;
+	}
+
+	switch(item->array[1]->type){
+	default:
+		werrstr("decimal fraction mantissa is not an int");
+		return nil;
+	case CBOR_UINT:
+		m = item->array[1]->uint;
+		break;
+	case CBOR_NINT:
+		m = -1.0 - item->array[1]->uint;
+		break;
+	}
+
+	if(e < -400 || e > 400){
+		werrstr("decimal fraction exponent %lld out of range", e);
+		return nil;
+	}
+
+	/* negative powers of ten are inexact; divide by the exact positive ones */
+	c = cbor_make_double(a, e < 0 ? m / pow10(-e) : m * pow10(e));
+	if(c == nil)
+		return nil;
+
+	cbor_free(a, item);
+
+	return c;
+}
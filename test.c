@@ -39,9 +39,17 @@ cbor_print(cbor *c, char *bp, char *be)
 		return seprint(bp, be, "-%llud", c->uint+1);
 
 	case CBOR_BYTE:
+		if(c->flags & CBOR_FLAG_INDEFINITE){
+			bracket = "()";
+			goto arr;
+		}
 		return seprint(bp, be, "%.*H", c->len, c->byte);
 
 	case CBOR_STRING:
+		if(c->flags & CBOR_FLAG_INDEFINITE){
+			bracket = "()";
+			goto arr;
+		}
 		return seprint(bp, be, "\"%.*s\"", c->len, c->string);
 
 	case CBOR_ARRAY:
@@ -219,6 +227,19 @@ static char *tests[] = {
 	"0xd74401020304",
 	"0xd818456449455446",
 	"0xd82076687474703a2f2f7777772e6578616d706c652e636f6d",
+
+/* indefinite length */
+	"0x5f42010243030405ff",
+	"0x7f657374726561646d696e67ff",
+	"0x9fff",
+	"0x9f018202039f0405ffff",
+	"0x9f01820203820405ff",
+	"0x83018202039f0405ff",
+	"0x83019f0203ff820405",
+	"0x9f0102030405060708090a0b0c0d0e0f101112131415161718181819ff",
+	"0xbf61610161629f0203ffff",
+	"0x826161bf61626163ff",
+	"0xbf6346756e016341" "6d7421ff",
 };
 
 static void
@@ -228,7 +249,7 @@ test_decenc(void)
 	ulong sz, ne;
 	char *p, pr[512];
 	uchar buf[512];
-	Bin *bin;
+	Bin *bin = nil;
 	cbor *c;
 
 	cbor_allocator cbor_bin_allocator = {
@@ -273,6 +294,57 @@ test_decenc(void)
 	//sleep(100000);
 }
 
+/* the fast decoder against the reference table, item for item */
+static void
+test_reference(void)
+{
+	int i, n, rv;
+	long na, nb;
+	char *p;
+	uchar buf[512], ea[512], eb[512];
+	cbor *a, *b;
+	cbor_decoder *ref;
+
+	static char *bad[] = {
+		"1c", "3d", "5e", "df", "f7", "f8", "fc", "ff",
+		"19", "1b00000000", "fb0000", "9a00", "c1", "81", "9f01", "a1", "62",
+		"7f6161", "5f6161ff", "bf01ff",
+	};
+
+	ref = cbor_decoder_new(&cbor_default_allocator, CBOR_DECODE_REFERENCE, nil);
+	assert(ref != nil);
+
+	for(i = 0; i < nelem(tests); i++){
+		p = tests[i];
+		if(strncmp(p, "0x", 2) == 0)
+			p += 2;
+		rv = dec16(buf, sizeof(buf), p, strlen(p));
+		assert(rv != -1);
+
+		a = cbor_decode(&cbor_default_allocator, buf, rv);
+		b = cbor_decoder_decode(ref, buf, rv);
+		assert(a != nil && b != nil);
+
+		na = cbor_encode(a, ea, sizeof(ea));
+		nb = cbor_encode(b, eb, sizeof(eb));
+		assert(na > 0 && na == nb && memcmp(ea, eb, na) == 0);
+
+		cbor_free(&cbor_default_allocator, a);
+		cbor_free(&cbor_default_allocator, b);
+	}
+
+	for(i = 0; i < nelem(bad); i++){
+		n = strlen(bad[i]);
+		rv = dec16(buf, sizeof(buf), bad[i], n);
+		assert(rv != -1);
+
+		assert(cbor_decode(&cbor_default_allocator, buf, rv) == nil);
+		assert(cbor_decoder_decode(ref, buf, rv) == nil);
+	}
+
+	cbor_decoder_free(ref);
+}
+
 static void
 test_encoder(void)
 {
@@ -374,6 +446,1524 @@ test_ints(void)
 	}
 }
 
+static void
+test_borrow(void)
+{
+	int rv;
+	ulong n;
+	uchar buf[128], out[128];
+	cbor *c, *e;
+
+	/* {"a": 1, "b": [h'01020304', "IETF"]} */
+	rv = dec16(buf, sizeof(buf), "a261610161628244010203046449455446", 34);
+	assert(rv != -1);
+
+	c = cbor_decode_borrow(&cbor_default_allocator, buf, rv);
+	if(c == nil)
+		sysfatal("cbor_decode_borrow: %r");
+
+	e = c->array[1]->value;
+	assert(e->type == CBOR_ARRAY && e->len == 2);
+	assert(e->array[0]->type == CBOR_BYTE);
+	assert(e->array[0]->flags & CBOR_FLAG_BORROWED);
+	assert(e->array[0]->byte == buf+8);
+	assert(e->array[1]->type == CBOR_STRING);
+	assert(e->array[1]->string == (char*)buf+13);
+
+	n = cbor_encode(c, out, sizeof(out));
+	assert(n == rv);
+	assert(memcmp(out, buf, n) == 0);
+
+	cbor_free(&cbor_default_allocator, c);
+}
+
+static void
+test_depth(void)
+{
+	int i, rv;
+	uchar buf[2001], tr[64];
+	cbor *c, *e;
+	cbor_decoder *dec;
+	cbor_limits lim;
+
+	/* [[[...[0]...]]] nested 2000 deep */
+	memset(buf, 0x81, 2000);
+	buf[2000] = 0x00;
+
+	c = cbor_decode(&cbor_default_allocator, buf, sizeof(buf));
+	assert(c == nil);
+
+	memset(&lim, 0, sizeof(lim));
+	lim.maxdepth = 4096;
+	dec = cbor_decoder_new(&cbor_default_allocator, 0, &lim);
+	assert(dec != nil);
+
+	c = cbor_decoder_decode(dec, buf, sizeof(buf));
+	if(c == nil)
+		sysfatal("cbor_decoder_decode: %r");
+
+	for(i = 0, e = c; e->type == CBOR_ARRAY; i++)
+		e = e->array[0];
+	assert(i == 2000 && e->type == CBOR_UINT);
+	assert(cbor_encode_size(c) == sizeof(buf));
+
+	cbor_free(&cbor_default_allocator, c);
+
+	/* truncated inside nested containers must not leak */
+	rv = dec16(tr, sizeof(tr), "a261610161628244010203046449", 28);
+	assert(rv != -1);
+	for(i = 0; i < rv; i++)
+		assert(cbor_decoder_decode(dec, tr, i) == nil);
+
+	cbor_decoder_free(dec);
+}
+
+static void
+test_limits(void)
+{
+	int i, rv;
+	long r;
+	uchar buf[64];
+	cbor *c;
+	cbor_limits lim;
+	cbor_decoder *dec;
+
+	/* a 9-byte header declaring 2^32 elements must not allocate them */
+	rv = dec16(buf, sizeof(buf), "9b000000010000000000", 20);
+	assert(cbor_decode(&cbor_default_allocator, buf, rv) == nil);
+	rv = dec16(buf, sizeof(buf), "9a7fffffff00", 12);
+	assert(cbor_decode(&cbor_default_allocator, buf, rv) == nil);
+	rv = dec16(buf, sizeof(buf), "ba0fffffff0000", 14);
+	assert(cbor_decode(&cbor_default_allocator, buf, rv) == nil);
+
+	/* nor when decoding incrementally, where the rest may follow */
+	dec = cbor_decoder_new(&cbor_default_allocator, 0, nil);
+	rv = dec16(buf, sizeof(buf), "9a7fffffff0102", 14);
+	assert(cbor_decoder_feed(dec, buf, rv, &c) == rv && c == nil);
+	rv = dec16(buf, sizeof(buf), "5a7fffffff0102", 14);
+	cbor_decoder_free(dec);
+	dec = cbor_decoder_new(&cbor_default_allocator, 0, nil);
+	assert(cbor_decoder_feed(dec, buf, rv, &c) == rv && c == nil);
+	cbor_decoder_free(dec);
+
+	/* declared lengths that do fit still arrive in pieces */
+	dec = cbor_decoder_new(&cbor_default_allocator, 0, nil);
+	rv = dec16(buf, sizeof(buf), "8a0102030405060708090a456162636465", 34);
+	for(i = 0; i < rv; i++){
+		r = cbor_decoder_feed(dec, buf+i, 1, &c);
+		assert(r == 1);
+		if(c != nil)
+			break;
+	}
+	assert(c != nil && i == 10 && c->len == 10 && c->array[9]->uint == 10);
+	cbor_free(&cbor_default_allocator, c);
+	for(i++; i < rv; i++){
+		r = cbor_decoder_feed(dec, buf+i, 1, &c);
+		assert(r == 1);
+	}
+	assert(c != nil && c->type == CBOR_BYTE && c->len == 5 && memcmp(c->byte, "abcde", 5) == 0);
+	cbor_free(&cbor_default_allocator, c);
+	cbor_decoder_free(dec);
+
+	/* [1, 2, 3, "abcd", [[4]]] */
+	rv = dec16(buf, sizeof(buf), "850102036461626364818104", 24);
+	assert(rv != -1);
+
+	memset(&lim, 0, sizeof(lim));
+	c = cbor_decode_limits(&cbor_default_allocator, buf, rv, &lim);
+	assert(c != nil);
+	cbor_free(&cbor_default_allocator, c);
+
+	lim.maxlen = 4;
+	assert(cbor_decode_limits(&cbor_default_allocator, buf, rv, &lim) == nil);
+	lim.maxlen = 5;
+	lim.maxstring = 3;
+	assert(cbor_decode_limits(&cbor_default_allocator, buf, rv, &lim) == nil);
+	lim.maxstring = 4;
+	lim.maxdepth = 2;
+	assert(cbor_decode_limits(&cbor_default_allocator, buf, rv, &lim) == nil);
+	lim.maxdepth = 3;
+	c = cbor_decode_limits(&cbor_default_allocator, buf, rv, &lim);
+	assert(c != nil);
+	cbor_free(&cbor_default_allocator, c);
+
+	/* eight nodes, seven slots and four bytes */
+	lim.maxalloc = 8*sizeof(cbor) + 7*sizeof(cbor*) + 4;
+	c = cbor_decode_limits(&cbor_default_allocator, buf, rv, &lim);
+	assert(c != nil);
+	cbor_free(&cbor_default_allocator, c);
+	lim.maxalloc--;
+	assert(cbor_decode_limits(&cbor_default_allocator, buf, rv, &lim) == nil);
+
+	/* indefinite lengths are counted as they grow */
+	rv = dec16(buf, sizeof(buf), "9f0102030405ff", 14);
+	memset(&lim, 0, sizeof(lim));
+	lim.maxlen = 4;
+	assert(cbor_decode_limits(&cbor_default_allocator, buf, rv, &lim) == nil);
+	lim.maxlen = 5;
+	c = cbor_decode_limits(&cbor_default_allocator, buf, rv, &lim);
+	assert(c != nil && c->len == 5);
+	cbor_free(&cbor_default_allocator, c);
+}
+
+static void
+test_feed(void)
+{
+	int i, j, rv, chunk;
+	char *p;
+	long r;
+	ulong n;
+	uchar buf[512], out[512];
+	cbor *c;
+	cbor_decoder *dec;
+
+	dec = cbor_decoder_new(&cbor_default_allocator, 0, nil);
+	assert(dec != nil);
+
+	for(i = 0; i < nelem(tests); i++){
+		p = tests[i];
+		if(strncmp(p, "0x", 2) == 0)
+			p += 2;
+		rv = dec16(buf, sizeof(buf), p, strlen(p));
+		assert(rv != -1);
+
+		for(chunk = 1; chunk <= rv; chunk++){
+			c = nil;
+			for(j = 0; j < rv; j += r){
+				n = rv - j;
+				if(n > chunk)
+					n = chunk;
+
+				r = cbor_decoder_feed(dec, buf+j, n, &c);
+				if(r < 0)
+					sysfatal("test %d chunk %d: cbor_decoder_feed: %r", i, chunk);
+				assert(c == nil || j + r == rv);
+			}
+			assert(c != nil);
+
+			n = cbor_encode(c, out, sizeof(out));
+			assert(n == rv && memcmp(out, buf, n) == 0);
+			cbor_free(&cbor_default_allocator, c);
+		}
+	}
+
+	/* two items in one chunk */
+	rv = dec16(buf, sizeof(buf), "8201026449455446", 16);
+	r = cbor_decoder_feed(dec, buf, rv, &c);
+	assert(r == 3 && c != nil && c->type == CBOR_ARRAY);
+	cbor_free(&cbor_default_allocator, c);
+	r = cbor_decoder_feed(dec, buf+3, rv-3, &c);
+	assert(r == rv-3 && c != nil && c->type == CBOR_STRING);
+	cbor_free(&cbor_default_allocator, c);
+
+	/* abandoned mid-item */
+	r = cbor_decoder_feed(dec, buf, 2, &c);
+	assert(r == 2 && c == nil);
+
+	cbor_decoder_free(dec);
+}
+
+static void
+test_cursor(void)
+{
+	int rv;
+	s64int v;
+	uchar buf[64];
+	cbor *c;
+	cbor_cursor cur, map, arr;
+
+	/* {"a": 1, "b": [2, -3], "c": "IETF"} 0.5 */
+	rv = dec16(buf, sizeof(buf), "a3616101616282022261636449455446f93800", 38);
+	assert(rv != -1);
+
+	cbor_cursor_init(&cur, buf, rv);
+	assert(cbor_next(&cur) == 1 && cur.type == CBOR_MAP && cur.len == 3);
+	assert(cbor_enter(&cur, &map) == 0);
+
+	assert(cbor_next(&map) == 1 && map.type == CBOR_STRING);
+	assert(map.len == 1 && map.byte[0] == 'a');
+	assert(cbor_next(&map) == 1 && map.type == CBOR_UINT && map.uint == 1);
+
+	assert(cbor_next(&map) == 1 && map.type == CBOR_STRING);
+	assert(cbor_next(&map) == 1 && map.type == CBOR_ARRAY && map.len == 2);
+	assert(cbor_enter(&map, &arr) == 0);
+	assert(cbor_next(&arr) == 1 && arr.type == CBOR_UINT && arr.uint == 2);
+	assert(cbor_next(&arr) == 1 && arr.type == CBOR_NINT);
+	v = -1 - (s64int)arr.uint;
+	assert(v == -3);
+	assert(cbor_next(&arr) == 0);
+	assert(cbor_leave(&map, &arr) == 0);
+
+	/* leave the map before reading "c" */
+	assert(cbor_next(&map) == 1 && map.type == CBOR_STRING);
+	assert(cbor_leave(&cur, &map) == 0);
+
+	assert(cbor_next(&cur) == 1 && cur.type == CBOR_DOUBLE && cur.d == 0.5);
+	assert(cbor_next(&cur) == 0);
+
+	/* the map is skipped whole when not entered */
+	cbor_cursor_init(&cur, buf, rv);
+	assert(cbor_next(&cur) == 1 && cur.type == CBOR_MAP);
+	assert(cbor_next(&cur) == 1 && cur.type == CBOR_DOUBLE);
+
+	/* negative ints agree with the tree */
+	buf[0] = 0x22;
+	c = cbor_decode(&cbor_default_allocator, buf, 1);
+	assert(c != nil && cbor_int(c, &v) == 0 && v == -3);
+	cbor_free(&cbor_default_allocator, c);
+
+	/* lengths beyond the input */
+	rv = dec16(buf, sizeof(buf), "9bffffffffffffffff00", 20);
+	cbor_cursor_init(&cur, buf, rv);
+	assert(cbor_next(&cur) == -1);
+}
+
+static char *badchunks[] = {
+	"5f00ff",
+	"7f4101ff",
+	"5f8100ff",
+	"5f5f4101ffff",
+};
+
+static void
+test_skip(void)
+{
+	int i, k, rv;
+	long n;
+	char *p;
+	uchar buf[512], *q, *deep;
+
+	for(i = 0; i < nelem(tests); i++){
+		p = tests[i];
+		if(strncmp(p, "0x", 2) == 0)
+			p += 2;
+		rv = dec16(buf, sizeof(buf), p, strlen(p));
+		assert(rv != -1);
+
+		if(cbor_item_len(buf, rv) != rv)
+			sysfatal("test %d: cbor_item_len: %r", i);
+		assert(cbor_item_len(buf, rv-1) == -1);
+	}
+
+	/* jump to the third element of [1, [2, 3], [4, 5]] */
+	rv = dec16(buf, sizeof(buf), "8301820203820405", 16);
+	q = cbor_skip(buf+1, rv-1, 2);
+	assert(q == buf+5 && cbor_item_len(q, buf+rv-q) == 3);
+	assert(cbor_skip(buf+1, rv-1, 4) == nil);
+
+	/* an item followed by another */
+	rv = dec16(buf, sizeof(buf), "9f01ff02", 8);
+	assert(cbor_item_len(buf, rv) == 3);
+	assert(cbor_skip(buf, rv, 2) == buf+rv);
+
+	/* chunks that are not strings of the same type */
+	for(i = 0; i < nelem(badchunks); i++){
+		rv = dec16(buf, sizeof(buf), badchunks[i], strlen(badchunks[i]));
+		assert(cbor_item_len(buf, rv) == -1);
+	}
+	rv = dec16(buf, sizeof(buf), "7f6161ff", 8);
+	assert(cbor_item_len(buf, rv) == rv);
+
+	/* a key with no value */
+	rv = dec16(buf, sizeof(buf), "bf6161ff", 8);
+	assert(cbor_item_len(buf, rv) == -1);
+	rv = dec16(buf, sizeof(buf), "bf616101ff", 10);
+	assert(cbor_item_len(buf, rv) == rv);
+
+	/* [_ [[_ [... 0]]]], as deep as allowed and one deeper */
+	deep = malloc(3*(CBOR_MAXDEPTH+1) + 1);
+	assert(deep != nil);
+	for(k = CBOR_MAXDEPTH; k <= CBOR_MAXDEPTH+1; k++){
+		for(i = 0; i < k; i++){
+			deep[2*i] = 0x9f;
+			deep[2*i+1] = 0x81;
+		}
+		deep[2*k] = 0x00;
+		memset(deep + 2*k + 1, 0xff, k);
+		n = cbor_item_len(deep, 3*k + 1);
+		assert(k == CBOR_MAXDEPTH ? n == 3*k + 1 : n == -1);
+	}
+	free(deep);
+}
+
+static void
+test_query(void)
+{
+	int rv;
+	uchar buf[128];
+	cbor_cursor cur;
+
+	/* {"a": 1, "state": {"peers": [{"addr": "x"}, {"addr": "10.0.0.2"}]}, "z": 55799(["q"])} */
+	rv = dec16(buf, sizeof(buf),
+		"a3616101657374617465a165706565727382a164616464726178"
+		"a164616464726831302e302e302e32617ad9d9f7816171", 98);
+	assert(rv != -1);
+
+	assert(cbor_query(buf, rv, "a", &cur) == 1 && cur.type == CBOR_UINT && cur.uint == 1);
+	assert(cbor_query(buf, rv, "state.peers[1].addr", &cur) == 1);
+	assert(cur.type == CBOR_STRING && cur.len == 8 && memcmp(cur.byte, "10.0.0.2", 8) == 0);
+	assert(cur.item == cur.byte - 1);
+
+	/* the span of a container */
+	assert(cbor_query(buf, rv, "state.peers", &cur) == 1 && cur.type == CBOR_ARRAY);
+	assert(cbor_item_len(cur.item, cur.e - cur.item) == 24);
+
+	/* tags are looked through */
+	assert(cbor_query(buf, rv, "z[0]", &cur) == 1 && cur.type == CBOR_STRING && cur.byte[0] == 'q');
+	assert(cbor_query(buf, rv, "", &cur) == 1 && cur.type == CBOR_MAP);
+
+	assert(cbor_query(buf, rv, "state.peers[2]", &cur) == 0);
+	assert(cbor_query(buf, rv, "state.peer", &cur) == 0);
+	assert(cbor_query(buf, rv, "a.b", &cur) == 0);
+	assert(cbor_query(buf, rv, "state[x]", &cur) == -1);
+	assert(cbor_query(buf, rv-1, "z[0]", &cur) == -1);
+}
+
+static void
+test_seq(void)
+{
+	int rv;
+	long n;
+	ulong used, off;
+	uchar buf[64];
+	cbor *c;
+	cbor_span span[8];
+
+	/* 1 [2, 3] "abc" {} then a truncated item */
+	rv = dec16(buf, sizeof(buf), "0182020363616263a082", 20);
+	assert(rv != -1);
+
+	n = cbor_seq_split(buf, rv, span, nelem(span));
+	assert(n == 4);
+	assert(span[0].off == 0 && span[0].len == 1);
+	assert(span[1].off == 1 && span[1].len == 3);
+	assert(span[2].off == 4 && span[2].len == 4);
+	assert(span[3].off == 8 && span[3].len == 1);
+	assert(span[3].off + span[3].len < rv);
+
+	/* a full span array stops early without error */
+	assert(cbor_seq_split(buf, rv, span, 2) == 2);
+	assert(cbor_seq_split(buf, 0, span, nelem(span)) == 0);
+
+	for(off = 0, n = 0; n < 4; n++){
+		c = cbor_decode_seq(&cbor_default_allocator, buf+off, rv-off, &used);
+		assert(c != nil && used == span[n].len);
+		cbor_free(&cbor_default_allocator, c);
+		off += used;
+	}
+	assert(cbor_decode_seq(&cbor_default_allocator, buf+off, rv-off, &used) == nil);
+}
+
+static void
+test_procs(void)
+{
+	int i, who[64];
+	long n, m;
+	ulong off;
+	uchar buf[512], out[512];
+	cbor *item[64];
+	cbor_span span[64];
+	cbor_allocator alloc[4];
+
+	for(i = 0; i < nelem(alloc); i++)
+		alloc[i] = cbor_default_allocator;
+
+	/* 1 [2, 3] "abc" ... repeated */
+	off = 0;
+	for(i = 0; i < 20; i++)
+		off += dec16(buf+off, sizeof(buf)-off, "0182020363616263", 16);
+
+	n = cbor_decode_procs(alloc, nelem(alloc), buf, off, span, item, who, nelem(item));
+	if(n < 0)
+		sysfatal("cbor_decode_procs: %r");
+	assert(n == 60);
+
+	/* items come back in order, and the runs cover them all */
+	m = 0;
+	for(i = 0; i < n; i++){
+		assert(i == 0 || who[i] >= who[i-1]);
+		m += cbor_encode(item[i], out+m, sizeof(out)-m);
+		cbor_free(&alloc[who[i]], item[i]);
+	}
+	assert(m == off && memcmp(out, buf, m) == 0);
+	assert(who[0] == 0 && who[n-1] == nelem(alloc)-1);
+
+	/* room for fewer items than there are */
+	assert(cbor_decode_procs(alloc, 2, buf, off, span, item, nil, 5) == 5);
+	assert(span[4].off + span[4].len == 12);
+	for(i = 0; i < 5; i++)
+		cbor_free(&cbor_default_allocator, item[i]);
+
+	/* one bad item loses the lot */
+	n = dec16(buf, sizeof(buf), "010203f40405", 12);
+	assert(cbor_decode_procs(alloc, 3, buf, n, span, item, who, nelem(item)) == -1);
+}
+
+typedef struct Peer Peer;
+struct Peer {
+	char	*addr;
+	u16int	port;
+};
+
+typedef struct State State;
+struct State {
+	u64int	id;
+	s32int	delta;
+	double	load;
+	uchar	*key;
+	ulong	nkey;
+	int	npeer;
+	Peer	peer[4];
+	uchar	tag;
+};
+
+static cbor_field peerfields[] = {
+	{.type = CBOR_STRING, .off = CBOR_OFF(Peer, addr), .size = sizeof(char*)},
+	{.type = CBOR_UINT, .off = CBOR_OFF(Peer, port), .size = sizeof(u16int)},
+};
+
+static cbor_field statefields[] = {
+	{.key = "id", .type = CBOR_UINT, .off = CBOR_OFF(State, id), .size = sizeof(u64int)},
+	{.key = "delta", .type = CBOR_NINT, .off = CBOR_OFF(State, delta), .size = sizeof(s32int)},
+	{.key = "load", .type = CBOR_DOUBLE, .off = CBOR_OFF(State, load), .size = sizeof(double)},
+	{.key = "key", .type = CBOR_BYTE, .off = CBOR_OFF(State, key), .size = sizeof(uchar*),
+		.lenoff = CBOR_OFF(State, nkey), .lensize = sizeof(ulong)},
+	{.key = "peers", .type = CBOR_ARRAY, .flags = CBOR_FIELD_REPEAT,
+		.off = CBOR_OFF(State, peer), .size = sizeof(Peer), .max = 4,
+		.lenoff = CBOR_OFF(State, npeer), .lensize = sizeof(int),
+		.sub = peerfields, .nsub = nelem(peerfields)},
+};
+
+static cbor_field statemap = {
+	.type = CBOR_MAP, .sub = statefields, .nsub = nelem(statefields),
+};
+
+static cbor_field tagged = {
+	.type = CBOR_TAG, .off = CBOR_OFF(State, tag), .size = sizeof(uchar), .sub = &statemap,
+};
+
+static void
+test_struct(void)
+{
+	int rv;
+	uchar buf[128];
+	State st;
+
+	/*
+	 * 7({"id": 42, "x": [1], "delta": -5, "load": 0.5, "key": h'0102',
+	 * "peers": [["a", 564], ["bc", 80]]})
+	 */
+	rv = dec16(buf, sizeof(buf),
+		"c7a6626964182a617881016564656c746124646c6f6164f93800636b6579420102"
+		"65706565727382826161190234826262631850", 104);
+	assert(rv != -1);
+
+	memset(&st, 0, sizeof(st));
+	if(cbor_decode_struct(buf, rv, &tagged, &st) != rv)
+		sysfatal("cbor_decode_struct: %r");
+
+	assert(st.tag == 7 && st.id == 42 && st.delta == -5 && st.load == 0.5);
+	assert(st.nkey == 2 && st.key[0] == 1 && st.key[1] == 2);
+	assert(st.npeer == 2);
+	assert(strcmp(st.peer[0].addr, "a") == 0 && st.peer[0].port == 564);
+	assert(strcmp(st.peer[1].addr, "bc") == 0 && st.peer[1].port == 80);
+
+	/* values that do not fit the field */
+	rv = dec16(buf, sizeof(buf), "a16564656c74611b0000000100000000", 32);
+	assert(cbor_decode_struct(buf, rv, &statemap, &st) == -1);
+	rv = dec16(buf, sizeof(buf), "a1626964626869", 14);
+	assert(cbor_decode_struct(buf, rv, &statemap, &st) == -1);
+
+	/* too many peers, and a peer short of a field */
+	rv = dec16(buf, sizeof(buf), "a165706565727385826000826000826000826000826000", 46);
+	assert(cbor_decode_struct(buf, rv, &statemap, &st) == -1);
+	rv = dec16(buf, sizeof(buf), "a165706565727381816161", 22);
+	assert(cbor_decode_struct(buf, rv, &statemap, &st) == -1);
+}
+
+static cbor*
+hook_count(cbor_allocator *a, u64int tag, cbor *item, void *arg)
+{
+	USED(a, tag);
+
+	(*(int*)arg)++;
+	return item;
+}
+
+static void
+test_taghook(void)
+{
+	int i, rv, ncall;
+	long m;
+	uchar buf[128];
+	cbor *c, **e;
+	cbor_decoder *dec;
+
+	dec = cbor_decoder_new(&cbor_default_allocator, 0, nil);
+	assert(dec != nil);
+
+	ncall = 0;
+	assert(cbor_decoder_hook(dec, CBOR_TAG_UNIXTIME, cbor_hook_unixtime, nil) == 0);
+	assert(cbor_decoder_hook(dec, CBOR_TAG_BIGNUM, cbor_hook_bignum, nil) == 0);
+	assert(cbor_decoder_hook(dec, CBOR_TAG_NEGBIGNUM, cbor_hook_bignum, nil) == 0);
+	assert(cbor_decoder_hook(dec, CBOR_TAG_DECIMAL, cbor_hook_decimal, nil) == 0);
+	assert(cbor_decoder_hook(dec, 100, hook_count, &ncall) == 0);
+
+	/*
+	 * [1(1500000000), 2(h'0100'), 3(h'00ff'), 4([-2, 27315]),
+	 * 2(h'010000000000000000'), 100("x"), 1(2.5)]
+	 */
+	rv = dec16(buf, sizeof(buf),
+		"87c11a59682f00c2420100c34200ffc48221196ab3c2490100000000000000"
+		"00d8646178c1f94100", 80);
+	assert(rv != -1);
+
+	for(i = 0; i < 2; i++){
+		if(i == 0)
+			c = cbor_decoder_decode(dec, buf, rv);
+		else {
+			/* hooked tags left open between chunks */
+			c = nil;
+			for(m = 0; m < rv && c == nil; m++)
+				assert(cbor_decoder_feed(dec, buf + m, 1, &c) == 1);
+		}
+		if(c == nil)
+			sysfatal("taghook: %r");
+
+		e = c->array;
+		assert(c->len == 7);
+		assert(e[0]->type == CBOR_UINT && e[0]->uint == 1500000000);
+		assert(e[1]->type == CBOR_UINT && e[1]->uint == 256);
+		assert(e[2]->type == CBOR_NINT && e[2]->uint == 255);
+		assert(e[3]->type == CBOR_DOUBLE && fabs(e[3]->d - 273.15) < 1e-9);
+		assert(e[4]->type == CBOR_TAG && e[4]->tag == 2 && e[4]->item->len == 9);
+		assert(e[5]->type == CBOR_STRING && e[5]->len == 1);
+		assert(e[6]->type == CBOR_DOUBLE && e[6]->d == 2.5);
+		assert(ncall == i+1);
+
+		cbor_free(&cbor_default_allocator, c);
+	}
+
+	/* a hook's error fails the item */
+	rv = dec16(buf, sizeof(buf), "82c16178c1f6", 12);
+	assert(cbor_decoder_decode(dec, buf, rv) == nil);
+	rv = dec16(buf, sizeof(buf), "c48201f6", 8);
+	assert(cbor_decoder_decode(dec, buf, rv) == nil);
+
+	/* and without the hooks, tags are nodes again */
+	c = cbor_decode(&cbor_default_allocator, buf, rv);
+	assert(c != nil && c->type == CBOR_TAG && c->item->type == CBOR_ARRAY);
+	cbor_free(&cbor_default_allocator, c);
+
+	cbor_decoder_free(dec);
+}
+
+static void
+test_intern(void)
+{
+	int i, rv;
+	char *id;
+	uchar buf[128];
+	cbor *c, *r;
+	cbor_intern *tab;
+	cbor_decoder *dec;
+
+	tab = cbor_intern_new(&cbor_default_allocator, 8, 3);
+	assert(tab != nil);
+	dec = cbor_decoder_new(&cbor_default_allocator, 0, nil);
+	assert(dec != nil);
+	cbor_decoder_intern(dec, tab);
+
+	/*
+	 * [{"id": 1, "ts": "id"}, {"id": 2, "ts": 3, "value": 4},
+	 * {"id": 3, "ts": 4, "toolongkey": 5, "x": 6}]
+	 */
+	rv = dec16(buf, sizeof(buf),
+		"83a262696401627473626964a362696402627473036576616c756504"
+		"a462696403627473046a746f6f6c6f6e676b657905617806", 104);
+	assert(rv != -1);
+
+	c = cbor_decoder_decode(dec, buf, rv);
+	if(c == nil)
+		sysfatal("intern: %r");
+
+	id = cbor_intern_str(tab, "id", 2);
+	assert(id != nil && strcmp(id, "id") == 0);
+
+	for(i = 0; i < 3; i++){
+		r = c->array[i];
+		assert(r->array[0]->key->string == id);
+		assert(r->array[0]->key->flags & CBOR_FLAG_INTERNED);
+		assert(r->array[1]->key->string == c->array[0]->array[1]->key->string);
+	}
+
+	/* values are copied */
+	r = c->array[0]->array[1]->value;
+	assert(r->type == CBOR_STRING && r->string != id && (r->flags & CBOR_FLAG_INTERNED) == 0);
+
+	/* too long, and past the table's three strings */
+	r = c->array[2];
+	assert((r->array[2]->key->flags & CBOR_FLAG_INTERNED) == 0);
+	assert((r->array[3]->key->flags & CBOR_FLAG_INTERNED) == 0);
+	assert(memcmp(r->array[3]->key->string, "x", 1) == 0);
+	assert(cbor_intern_str(tab, "x", 1) == nil);
+	cbor_free(&cbor_default_allocator, c);
+
+	/* keys split across chunks are interned all the same */
+	c = nil;
+	for(i = 0; i < rv; i++)
+		assert(cbor_decoder_feed(dec, buf+i, 1, &c) == 1);
+	assert(c != nil);
+	r = c->array[1];
+	assert(r->array[0]->key->string == id);
+	assert(r->array[2]->key->string == cbor_intern_str(tab, "value", 5));
+	assert(r->array[2]->key->flags & CBOR_FLAG_INTERNED);
+	assert((c->array[2]->array[2]->key->flags & CBOR_FLAG_INTERNED) == 0);
+
+	cbor_free(&cbor_default_allocator, c);
+	cbor_decoder_free(dec);
+
+	/* the keys outlive the decoder */
+	assert(cbor_intern_str(tab, "ts", 2) != nil);
+	cbor_intern_free(tab);
+}
+
+static void
+test_mapindex(void)
+{
+	int i, rv;
+	char key[16];
+	s64int v;
+	uchar *buf;
+	ulong n;
+	cbor *m, *c, *x;
+	cbor_decoder *dec;
+	cbor_allocator *a;
+
+	a = &cbor_default_allocator;
+
+	/* {"ab": 1, "a": 2}: keys match whole, not by prefix */
+	buf = malloc(64);
+	assert(buf != nil);
+	rv = dec16(buf, 64, "a262616201616102", 16);
+	c = cbor_decode(a, buf, rv);
+	assert(c != nil);
+	assert(cbor_unpack(a, c, "{Si}", "a", &v) == 0 && v == 2);
+	assert(cbor_unpack(a, c, "{Si}", "abc", &v) < 0);
+	assert(cbor_map_get(c, "", 0) == nil);
+	cbor_free(a, c);
+	free(buf);
+
+	/* a wide map, with a duplicate key and a non-text one */
+	m = cbor_make_map(a, 0);
+	for(i = 0; i < 200; i++){
+		snprint(key, sizeof(key), "k%d", i);
+		m = cbor_map_append(a, m, cbor_make_string(a, key, strlen(key)), cbor_make_uint(a, i));
+		assert(m != nil);
+	}
+	m = cbor_map_append(a, m, cbor_make_string(a, "k7", 2), cbor_make_uint(a, 1000));
+	m = cbor_map_append(a, m, cbor_make_uint(a, 7), cbor_make_uint(a, 1001));
+	assert(m != nil);
+
+	n = cbor_encode_size(m);
+	buf = malloc(n);
+	assert(buf != nil && cbor_encode(m, buf, n) == n);
+
+	assert(cbor_map_index(a, m) == 0 && (m->flags & CBOR_FLAG_INDEXED) != 0);
+
+	dec = cbor_decoder_new(a, CBOR_DECODE_INDEX, nil);
+	assert(dec != nil);
+	c = cbor_decoder_decode(dec, buf, n);
+	assert(c != nil && (c->flags & CBOR_FLAG_INDEXED) != 0);
+
+	for(i = 0; i < 200; i++){
+		snprint(key, sizeof(key), "k%d", i);
+		x = cbor_map_get(c, key, strlen(key));
+		assert(x != nil && x->uint == i);
+		x = cbor_map_get(m, key, strlen(key));
+		assert(x != nil && x->uint == i);
+	}
+	assert(cbor_map_get(c, "k200", 4) == nil);
+	assert(cbor_unpack(a, c, "{SiSi}", "k199", &v, "k0", &v) == 0 && v == 0);
+
+	/* appending drops the index; lookups still scan */
+	m = cbor_map_append(a, m, cbor_make_string(a, "new", 3), cbor_make_uint(a, 1));
+	assert(m != nil && (m->flags & CBOR_FLAG_INDEXED) == 0);
+	assert(cbor_map_get(m, "new", 3) != nil && cbor_map_get(m, "k7", 2)->uint == 7);
+	assert(cbor_map_index(a, m) == 0 && cbor_map_index(a, m) == 0);
+	assert(cbor_map_get(m, "new", 3) != nil);
+
+	/* small maps are left alone */
+	rv = dec16(buf, n, "a1616101", 8);
+	x = cbor_decoder_decode(dec, buf, rv);
+	assert(x != nil && (x->flags & CBOR_FLAG_INDEXED) == 0);
+
+	cbor_free(a, x);
+	cbor_free(a, c);
+	cbor_free(a, m);
+	cbor_decoder_free(dec);
+	free(buf);
+}
+
+static void
+test_encode_alloc(void)
+{
+	int i;
+	ulong n, len;
+	uchar small[16], *big, *p;
+	cbor *c;
+	cbor_allocator *a;
+
+	a = &cbor_default_allocator;
+
+	c = cbor_make_array(a, 0);
+	for(i = 0; i < 500; i++){
+		c = cbor_array_append(a, c, cbor_make_string(a, "abcdefghij", i % 11));
+		assert(c != nil);
+	}
+	c = cbor_array_append(a, c, cbor_make_tag(a, 1, cbor_make_double(a, 1.5)));
+	assert(c != nil);
+
+	n = cbor_encode_size(c);
+	big = malloc(n);
+	assert(big != nil && cbor_encode(c, big, n) == n);
+
+	/* outgrows the caller's storage */
+	p = cbor_encode_alloc(a, c, small, sizeof(small), &len);
+	assert(p != nil && p != small && len == n && memcmp(p, big, n) == 0);
+	free(p);
+
+	/* no storage at all */
+	p = cbor_encode_alloc(a, c, nil, 0, &len);
+	assert(p != nil && len == n && memcmp(p, big, n) == 0);
+	free(p);
+
+	/* enough storage is used as it is */
+	memset(big, 0, n);
+	p = cbor_encode_alloc(a, c, big, n, &len);
+	assert(p == big && len == n);
+	assert(cbor_encode_size(c) == n);
+
+	/* a fixed buffer too small for the strings or the tag fails cleanly */
+	assert(cbor_encode(c, small, sizeof(small)) == 0);
+	assert(cbor_encode(c, big, n-1) == 0);
+
+	free(big);
+	cbor_free(a, c);
+}
+
+typedef struct wsink wsink;
+struct wsink {
+	uchar	buf[256];
+	long	n;
+	int	calls;
+};
+
+static long
+wsinkflush(void *arg, uchar *buf, long n)
+{
+	wsink *k;
+
+	k = arg;
+	if(k->n + n > sizeof(k->buf))
+		return -1;
+
+	memmove(k->buf + k->n, buf, n);
+	k->n += n;
+	k->calls++;
+
+	return n;
+}
+
+static void
+wput(cbor_writer *w, char *long40)
+{
+	cbor_put_tag(w, 7);
+	cbor_begin_array(w, 6);
+	cbor_put_uint(w, 23);
+	cbor_put_int(w, -500);
+	cbor_put_string(w, long40, 40);
+	cbor_put_byte(w, (uchar*)"\1\2\3", 3);
+	cbor_begin_map(w, -1);
+	cbor_put_string(w, "x", 1);
+	cbor_put_double(w, 1.5);
+	cbor_put_string(w, "y", 1);
+	cbor_put_null(w);
+	cbor_end(w);
+	cbor_put_float(w, 2.5);
+}
+
+static void
+test_shortfloat(void)
+{
+	int i, n;
+	u32int v;
+	ulong len;
+	double d, want;
+	uchar buf[16], out[512], *p;
+	cbor *c;
+	cbor_writer w;
+	cbor_allocator *a;
+	static struct {
+		double	d;
+		char	*hex;
+	} tab[] = {
+		{0.0, "f90000"},
+		{1.0, "f93c00"},
+		{1.5, "f93e00"},
+		{65504.0, "f97bff"},
+		{5.960464477539063e-8, "f90001"},
+		{0.00006103515625, "f90400"},
+		{-4.0, "f9c400"},
+		{100000.0, "fa47c35000"},
+		{3.4028234663852886e+38, "fa7f7fffff"},
+		{1.1, "fb3ff199999999999a"},
+		{1.0e+300, "fb7e37e43c8800759c"},
+		{-4.1, "fbc010666666666666"},
+	};
+
+	a = &cbor_default_allocator;
+
+	/* every half, against the arithmetic */
+	for(i = 0; i < 0x10000; i++){
+		n = (i>>10) & 0x1f;
+		buf[0] = 0xf9;
+		buf[1] = i>>8;
+		buf[2] = i;
+		c = cbor_decode(a, buf, 3);
+		assert(c != nil && c->type == CBOR_DOUBLE);
+		d = c->d;
+		cbor_free(a, c);
+		if(n == 31 && (i & 0x3ff) != 0){
+			assert(isNaN(d));
+			continue;
+		}
+		if(n == 0)
+			want = ldexp(i & 0x3ff, -24);
+		else if(n == 31)
+			want = Inf(0);
+		else
+			want = ldexp((i & 0x3ff) + 1024, n - 25);
+		if(i & 0x8000)
+			want = -want;
+		assert(memcmp(&d, &want, 8) == 0);
+
+		/* and back, to the same half */
+		c = cbor_make_double(a, d);
+		p = cbor_encode_preferred(a, c, buf, sizeof(buf), &len);
+		assert(p == buf && len == 3 && buf[0] == 0xf9 && (buf[1]<<8 | buf[2]) == i);
+		cbor_free(a, c);
+	}
+
+	/* RFC 8949 appendix A, as doubles and through the writer */
+	cbor_writer_init(&w, out, sizeof(out), nil, nil);
+	for(i = 0; i < nelem(tab); i++){
+		c = cbor_make_double(a, tab[i].d);
+		p = cbor_encode_preferred(a, c, buf, sizeof(buf), &len);
+		n = dec16(out+256, 16, tab[i].hex, strlen(tab[i].hex));
+		assert(p == buf && len == n && memcmp(buf, out+256, n) == 0);
+		cbor_free(a, c);
+
+		assert(cbor_put_real(&w, tab[i].d) == 0);
+		assert(memcmp(w.p - n, out+256, n) == 0);
+	}
+
+	/* the odd ones out */
+	c = cbor_make_double(a, NaN());
+	p = cbor_encode_preferred(a, c, buf, sizeof(buf), &len);
+	assert(p != nil && len == 3 && memcmp(buf, "\xf9\x7e\x00", 3) == 0);
+	cbor_free(a, c);
+	c = cbor_make_double(a, Inf(-1));
+	p = cbor_encode_preferred(a, c, buf, sizeof(buf), &len);
+	assert(p != nil && len == 3 && memcmp(buf, "\xf9\xfc\x00", 3) == 0);
+	cbor_free(a, c);
+
+	/* a single is shortened too, but not without asking */
+	c = cbor_make_float(a, 0.5);
+	p = cbor_encode_preferred(a, c, buf, sizeof(buf), &len);
+	assert(p != nil && len == 3 && memcmp(buf, "\xf9\x38\x00", 3) == 0);
+	assert(cbor_encode_size(c) == 5 && cbor_encode(c, buf, sizeof(buf)) == 5);
+	cbor_free(a, c);
+
+	/* a single just below the half subnormals */
+	v = 0x33000001;
+	c = cbor_make_float(a, 0);
+	memcpy(&c->f, &v, 4);
+	p = cbor_encode_preferred(a, c, buf, sizeof(buf), &len);
+	assert(p != nil && len == 5 && buf[0] == 0xfa);
+	cbor_free(a, c);
+}
+
+static void
+test_patch(void)
+{
+	int n;
+	vlong ticks, delta, temp;
+	u64int u;
+	s64int i;
+	uchar buf[64], old[64];
+	cbor *c, *v;
+	cbor_writer w;
+	cbor_allocator *a;
+
+	a = &cbor_default_allocator;
+
+	/* a status record with three counters kept at full width */
+	cbor_writer_init(&w, buf, sizeof(buf), nil, nil);
+	cbor_begin_map(&w, 4);
+	cbor_put_string(&w, "name", 4);
+	cbor_put_string(&w, "pump", 4);
+	cbor_put_string(&w, "ticks", 5);
+	ticks = cbor_put_uint_fixed(&w, 0);
+	cbor_put_string(&w, "delta", 5);
+	delta = cbor_put_int_fixed(&w, 5);
+	cbor_put_string(&w, "temp", 4);
+	temp = cbor_put_double_fixed(&w, 20.0);
+	assert(w.err == 0 && ticks > 0 && delta > ticks && temp > delta);
+	n = w.n;
+	assert(buf[ticks] == 0x1b && buf[delta] == 0x1b && buf[temp] == 0xfb);
+	memmove(old, buf, n);
+
+	assert(cbor_patch_uint(buf, n, ticks, 1ULL<<40) == 0);
+	assert(cbor_patch_int(buf, n, delta, -3) == 0);
+	assert(cbor_patch_double(buf, n, temp, 21.5) == 0);
+
+	/* only the fields moved */
+	assert(memcmp(buf, old, ticks) == 0);
+	assert(memcmp(buf+ticks+9, old+ticks+9, delta-ticks-9) == 0);
+	assert(memcmp(buf+delta+9, old+delta+9, temp-delta-9) == 0);
+
+	c = cbor_decode(a, buf, n);
+	assert(c != nil);
+	assert(cbor_unpack(a, c, "{SuSi}", "ticks", &u, "delta", &i) == 0);
+	assert(u == 1ULL<<40 && i == -3);
+	v = cbor_map_get(c, "temp", 4);
+	assert(v != nil && v->type == CBOR_DOUBLE && v->d == 21.5);
+	cbor_free(a, c);
+
+	/* what is not a field is left alone */
+	assert(cbor_patch_uint(buf, n, temp, 1) < 0);
+	assert(cbor_patch_double(buf, n, ticks, 1) < 0);
+	assert(cbor_patch_uint(buf, n, 0, 1) < 0);
+	assert(cbor_patch_uint(buf, n, n-8, 1) < 0);
+	assert(cbor_patch_uint(buf, n, -1, 1) < 0);
+
+	/* a full writer has no field to give */
+	cbor_writer_init(&w, buf, 4, nil, nil);
+	assert(cbor_put_uint_fixed(&w, 1) < 0 && w.n == 9);
+}
+
+static void
+test_raw(void)
+{
+	int rv;
+	ulong len;
+	uchar buf[64], out[64], seg0[16];
+	cbor *c, *t;
+	cbor_seg seg[4];
+	cbor_decoder *dec;
+	cbor_allocator *a;
+
+	a = &cbor_default_allocator;
+
+	/* [1, [2, 3], {_ "a": [4]}, "x"], with the inner array and map kept encoded */
+	rv = dec16(buf, sizeof(buf), "8401820203bf61618104ff6178", 26);
+	assert(rv == 13);
+
+	dec = cbor_decoder_new(a, CBOR_DECODE_BORROW, nil);
+	assert(dec != nil);
+	cbor_decoder_raw(dec, 1);
+	c = cbor_decoder_decode(dec, buf, rv);
+	assert(c != nil && c->type == CBOR_ARRAY && c->len == 4);
+	assert(c->array[0]->type == CBOR_UINT && c->array[3]->type == CBOR_STRING);
+	t = c->array[1];
+	assert(t->type == CBOR_RAW && t->byte == buf+2 && t->len == 3);
+	t = c->array[2];
+	assert(t->type == CBOR_RAW && t->byte == buf+5 && t->len == 6);
+	assert(cbor_encode_size(c) == rv);
+	assert(cbor_encode(c, out, sizeof(out)) == rv && memcmp(out, buf, rv) == 0);
+
+	/* raw bytes are referenced by the segment encoder */
+	assert(cbor_encode_segs(c, seg0, sizeof(seg0), seg, nelem(seg), 6) == 3);
+	assert(seg[1].p == buf+5 && seg[1].n == 6);
+
+	/* but not encoded canonically, which could not be promised for them */
+	assert(cbor_encode_canonical(a, c, out, sizeof(out), &len) == nil);
+	cbor_free(a, c);
+
+	/* the root itself */
+	cbor_decoder_raw(dec, 0);
+	c = cbor_decoder_decode(dec, buf, rv);
+	assert(c != nil && c->type == CBOR_RAW && c->len == rv);
+	cbor_free(a, c);
+	cbor_decoder_free(dec);
+
+	/* not from chunks, where the tree would depend on the breaks */
+	dec = cbor_decoder_new(a, 0, nil);
+	assert(dec != nil);
+	cbor_decoder_raw(dec, 1);
+	c = nil;
+	assert(cbor_decoder_feed(dec, buf, rv, &c) < 0 && c == nil);
+	cbor_decoder_raw(dec, -1);
+	assert(cbor_decoder_feed(dec, buf, rv, &c) == rv && c != nil);
+	assert(c->array[2]->type == CBOR_MAP);
+	cbor_free(a, c);
+	cbor_decoder_free(dec);
+
+	/* made by hand, it must be one whole item */
+	assert(cbor_make_raw(a, buf+2, 4) == nil);
+	assert(cbor_make_raw(a, buf+2, 2) == nil);
+	c = cbor_make_raw(a, buf+2, 3);
+	assert(c != nil && c->byte != buf+2);
+	t = cbor_make_tag(a, 9, c);
+	assert(cbor_encode(t, out, sizeof(out)) == 4 && out[0] == 0xc9 && memcmp(out+1, buf+2, 3) == 0);
+	cbor_free(a, t);
+}
+
+static void
+test_segs(void)
+{
+	int i, n;
+	ulong len, off;
+	uchar *data, want[2048], buf[64], *p;
+	cbor *c;
+	cbor_seg seg[8];
+	cbor_allocator *a;
+
+	a = &cbor_default_allocator;
+
+	/* an Rread: 117([5, h'...']) with a 1000 byte payload */
+	data = malloc(1000);
+	assert(data != nil);
+	for(i = 0; i < 1000; i++)
+		data[i] = i;
+
+	c = cbor_pack(a, "t[ubs]", (u64int)117, (u64int)5, 1000, data, 2, "ok");
+	assert(c != nil);
+	len = cbor_encode(c, want, sizeof(want));
+	assert(len > 1000);
+
+	n = cbor_encode_segs(c, buf, sizeof(buf), seg, nelem(seg), 64);
+	assert(n == 3);
+	assert(seg[0].p == buf && seg[2].p == seg[0].p + seg[0].n);
+	assert(seg[1].p == c->item->array[1]->byte && seg[1].n == 1000);
+
+	off = 0;
+	for(i = 0; i < n; i++){
+		assert(off + seg[i].n <= len && memcmp(want + off, seg[i].p, seg[i].n) == 0);
+		off += seg[i].n;
+	}
+	assert(off == len);
+
+	/* under the threshold, everything is copied */
+	n = cbor_encode_segs(c, want + len, sizeof(want) - len, seg, nelem(seg), 1001);
+	assert(n == 1 && seg[0].n == len && memcmp(seg[0].p, want, len) == 0);
+
+	/* too few segments, or too little room for the headers */
+	assert(cbor_encode_segs(c, buf, sizeof(buf), seg, 2, 64) < 0);
+	assert(cbor_encode_segs(c, buf, 4, seg, nelem(seg), 64) < 0);
+	cbor_free(a, c);
+
+	/* a lazy array, past the tag's two bytes, is referenced whole */
+	p = want + 2;
+	c = cbor_decode_lazy(a, p, len - 2);
+	assert(c != nil && (c->flags & CBOR_FLAG_LAZY) != 0);
+	n = cbor_encode_segs(c, buf, sizeof(buf), seg, nelem(seg), 64);
+	assert(n == 1 && seg[0].p == p && seg[0].n == len - 2);
+	cbor_free(a, c);
+
+	free(data);
+}
+
+static void
+test_canonical(void)
+{
+	int i, n, rv;
+	ulong len;
+	char key[32], *in, *want;
+	uchar buf[128], wbuf[128], out[128], *p;
+	cbor *c, *m, *e;
+	cbor_allocator *a;
+
+	a = &cbor_default_allocator;
+
+	/*
+	 * an indefinite map, in no order, with an indefinite inner map,
+	 * a long 1, a chunked string and a double that fits a half
+	 */
+	in = "bf626161f66162bf617a01617902ff8101fb7e37e43c8800759c61611801"
+		"207f6261626163ff0afb3ff8000000000000ff";
+	want = "a60af93e0020636162636161016162a2617902617a01626161f68101fb7e37e43c8800759c";
+
+	n = dec16(wbuf, sizeof(wbuf), want, strlen(want));
+	rv = dec16(buf, sizeof(buf), in, strlen(in));
+	assert(n > 0 && rv > 0);
+
+	c = cbor_decode(a, buf, rv);
+	assert(c != nil);
+	p = cbor_encode_canonical(a, c, out, sizeof(out), &len);
+	assert(p == out && len == n && memcmp(out, wbuf, n) == 0);
+	cbor_free(a, c);
+
+	/* lazy maps are expanded, and the output outgrows a small buffer */
+	c = cbor_decode_lazy(a, buf, rv);
+	assert(c != nil && (c->flags & CBOR_FLAG_LAZY) != 0);
+	p = cbor_encode_canonical(a, c, out, 4, &len);
+	assert(p != nil && p != out && len == n && memcmp(p, wbuf, n) == 0);
+	free(p);
+	cbor_free(a, c);
+
+	/* more keys than fit the sort's own storage, and longer */
+	m = cbor_make_map(a, 0);
+	for(i = 39; i >= 0; i--){
+		snprint(key, sizeof(key), "key-%02d-0123456789abcdef", i);
+		m = cbor_map_append(a, m, cbor_make_string(a, key, strlen(key)), cbor_make_uint(a, i));
+		assert(m != nil);
+	}
+	p = cbor_encode_canonical(a, m, nil, 0, &len);
+	assert(p != nil);
+	cbor_free(a, m);
+
+	m = cbor_decode(a, p, len);
+	assert(m != nil && m->len == 40);
+	for(i = 0; i < 40; i++){
+		e = m->array[i];
+		assert(e->value->uint == i);
+	}
+	free(p);
+
+	/* equal keys have no order */
+	e = cbor_make_string(a, "x", 1);
+	assert(cbor_map_append(a, m, e, cbor_make_null(a)) != nil);
+	e = cbor_make_string(a, "x", 1);
+	assert(cbor_map_append(a, m, e, cbor_make_uint(a, 0)) != nil);
+	assert(cbor_encode_canonical(a, m, nil, 0, &len) == nil);
+	cbor_free(a, m);
+}
+
+static void
+test_sizecache(void)
+{
+	int i;
+	ulong n;
+	uchar buf[256];
+	cbor *c, *row, *s;
+	cbor_allocator *a;
+
+	a = &cbor_default_allocator;
+
+	c = cbor_make_array(a, 0);
+	for(i = 0; i < 4; i++){
+		row = cbor_pack(a, "[uss]", (u64int)i, 3, "abc", 5, "defgh");
+		assert(row != nil && cbor_array_append(a, c, row) != nil);
+	}
+	row = c->array[2];
+
+	/* the plain size keeps nothing */
+	n = cbor_encode_size(c);
+	assert(n == cbor_encode(c, buf, sizeof(buf)));
+	assert((c->flags & CBOR_FLAG_SIZED) == 0);
+
+	assert(cbor_encode_size_cached(c) == n);
+	assert((c->flags & CBOR_FLAG_SIZED) != 0 && c->esize == n);
+	assert((row->flags & CBOR_FLAG_SIZED) != 0);
+
+	/* the plain size still sees changes made in place */
+	s = row->array[1];
+	s->len = 2;
+	assert(cbor_encode_size(c) == n - 1);
+	s->len = 3;
+
+	/* an append forgets the row's size; the root is touched by hand */
+	assert(cbor_array_append(a, row, cbor_make_uint(a, 1000)) != nil);
+	assert((row->flags & CBOR_FLAG_SIZED) == 0);
+	assert(cbor_encode_size(c) == n + 3);
+	cbor_touch(c);
+	assert(cbor_encode_size_cached(c) == n + 3);
+	assert(cbor_encode(c, buf, sizeof(buf)) == n + 3);
+
+	/* and for maps */
+	s = cbor_pack(a, "{susu}", 1, "x", (u64int)1, 1, "y", (u64int)2);
+	assert(s != nil && cbor_array_append(a, c, s) != nil);
+	cbor_touch(c);
+	n = cbor_encode_size_cached(c);
+	assert(cbor_map_append(a, s, cbor_make_string(a, "z", 1), cbor_make_null(a)) != nil);
+	assert((s->flags & CBOR_FLAG_SIZED) == 0);
+	cbor_touch(c);
+	assert(cbor_encode_size_cached(c) == n + 3);
+	assert(cbor_encode(c, buf, sizeof(buf)) == n + 3);
+
+	cbor_free(a, c);
+}
+
+static void
+test_writer(void)
+{
+	ulong n;
+	char *s;
+	uchar want[128], buf[128], tiny[9];
+	cbor *c, *m;
+	cbor_allocator *a;
+	cbor_writer w;
+	wsink k;
+
+	a = &cbor_default_allocator;
+	s = "0123456789012345678901234567890123456789";
+
+	/* the same items built as a tree */
+	m = cbor_make_map(a, 0);
+	m = cbor_map_append(a, m, cbor_make_string(a, "x", 1), cbor_make_double(a, 1.5));
+	m = cbor_map_append(a, m, cbor_make_string(a, "y", 1), cbor_make_null(a));
+	m->flags |= CBOR_FLAG_INDEFINITE;
+	c = cbor_pack(a, "t[uisbcf]", (u64int)7, (u64int)23, (s64int)-500, 40, s, 3, "\1\2\3", m, 2.5);
+	assert(c != nil);
+	n = cbor_encode(c, want, sizeof(want));
+	assert(n > 0);
+	cbor_free(a, c);
+
+	cbor_writer_init(&w, buf, sizeof(buf), nil, nil);
+	wput(&w, s);
+	assert(w.err == 0 && w.n == n && w.p - w.s == n);
+	assert(memcmp(buf, want, n) == 0);
+
+	/* without a flush, what does not fit is still counted */
+	cbor_writer_init(&w, tiny, sizeof(tiny), nil, nil);
+	wput(&w, s);
+	assert(w.err != 0 && w.n == n);
+	assert(cbor_end(&w) < 0 && w.n == n+1);
+
+	/* through a small buffer, the string going straight to flush */
+	memset(&k, 0, sizeof(k));
+	cbor_writer_init(&w, tiny, sizeof(tiny), wsinkflush, &k);
+	wput(&w, s);
+	assert(cbor_writer_flush(&w) == 0);
+	assert(w.err == 0 && k.n == n && k.calls > 2);
+	assert(memcmp(k.buf, want, n) == 0);
+
+	/* a failed flush sticks */
+	k.n = sizeof(k.buf);
+	cbor_writer_init(&w, tiny, sizeof(tiny), wsinkflush, &k);
+	wput(&w, s);
+	assert(w.err != 0 && cbor_put_null(&w) < 0 && cbor_writer_flush(&w) < 0);
+}
+
+static void
+test_indefinite(void)
+{
+	int rv, glen;
+	ulong n;
+	char *greet;
+	uchar buf[64];
+	cbor *c;
+	cbor_decoder *dec;
+	cbor_cursor cur, sub;
+
+	/* (_ h'0102', h'030405') joined into one string */
+	rv = dec16(buf, sizeof(buf), "5f42010243030405ff", 18);
+	dec = cbor_decoder_new(&cbor_default_allocator, CBOR_DECODE_COALESCE, nil);
+	c = cbor_decoder_decode(dec, buf, rv);
+	assert(c != nil && c->type == CBOR_BYTE && c->flags == 0 && c->len == 5);
+	assert(memcmp(c->byte, buf+2, 2) == 0 && memcmp(c->byte+2, buf+5, 3) == 0);
+	cbor_free(&cbor_default_allocator, c);
+	cbor_decoder_free(dec);
+
+	/* unpack joins chunks by itself */
+	rv = dec16(buf, sizeof(buf), "bf686772656574696e677f6368656c626c6fffff", 40);
+	c = cbor_decode(&cbor_default_allocator, buf, rv);
+	assert(c != nil);
+	assert(cbor_unpack(&cbor_default_allocator, c, "{Ss}", "greeting", &glen, &greet) == 0);
+	assert(glen == 5 && strcmp(greet, "hello") == 0);
+	free(greet);
+	cbor_free(&cbor_default_allocator, c);
+
+	/* a map in an array that is started before its length is known */
+	n = cbor_encode_indefinite(CBOR_ARRAY, buf, sizeof(buf));
+	c = cbor_pack(&cbor_default_allocator, "{su}", 1, "a", (u64int)1);
+	n += cbor_encode(c, buf+n, sizeof(buf)-n);
+	n += cbor_encode(c, buf+n, sizeof(buf)-n);
+	cbor_free(&cbor_default_allocator, c);
+	n += cbor_encode_break(buf+n, sizeof(buf)-n);
+	assert(n == 10);
+
+	cbor_cursor_init(&cur, buf, n);
+	assert(cbor_next(&cur) == 1 && cur.type == CBOR_ARRAY);
+	assert(cur.flags & CBOR_FLAG_INDEFINITE);
+	assert(cbor_enter(&cur, &sub) == 0);
+	assert(cbor_next(&sub) == 1 && sub.type == CBOR_MAP && sub.len == 1);
+	assert(cbor_leave(&cur, &sub) == 0);
+	assert(cbor_next(&cur) == 0 && cur.p == buf+n);
+
+	/* breaks where there is nothing to close */
+	buf[0] = 0xff;
+	assert(cbor_decode(&cbor_default_allocator, buf, 1) == nil);
+	rv = dec16(buf, sizeof(buf), "bf6161ff", 8);
+	assert(cbor_decode(&cbor_default_allocator, buf, rv) == nil);
+	rv = dec16(buf, sizeof(buf), "5f01ff", 6);
+	assert(cbor_decode(&cbor_default_allocator, buf, rv) == nil);
+
+	/* an indefinite-length chunk, joined or not */
+	rv = dec16(buf, sizeof(buf), "5f5f4101ffff", 12);
+	assert(cbor_decode(&cbor_default_allocator, buf, rv) == nil);
+	dec = cbor_decoder_new(&cbor_default_allocator, CBOR_DECODE_COALESCE, nil);
+	assert(cbor_decoder_decode(dec, buf, rv) == nil);
+	cbor_decoder_free(dec);
+}
+
+static void
+test_flat(void)
+{
+	int i, rv;
+	ulong n;
+	char *p;
+	uchar buf[512], out[512];
+	cbor *c;
+	cbor_scaninfo si;
+
+	/* {"a": 1, "b": [h'01020304', "IETF"]} */
+	rv = dec16(buf, sizeof(buf), "a261610161628244010203046449455446", 34);
+	assert(cbor_scan(&cbor_default_allocator, buf, rv, &si) == 0);
+	assert(si.len == rv && si.nodes == 9 && si.bytes == 10 && si.depth == 2);
+
+	/* trailing bytes are not part of the item */
+	assert(cbor_scan(&cbor_default_allocator, buf, rv+3, &si) == 0 && si.len == rv);
+	assert(cbor_scan(&cbor_default_allocator, buf, rv-1, &si) < 0);
+
+	for(i = 0; i < nelem(tests); i++){
+		p = tests[i];
+		if(strncmp(p, "0x", 2) == 0)
+			p += 2;
+		rv = dec16(buf, sizeof(buf), p, strlen(p));
+		assert(rv != -1);
+
+		c = cbor_decode_flat(&cbor_default_allocator, buf, rv);
+		if(c == nil)
+			sysfatal("test %d: cbor_decode_flat: %r", i);
+
+		n = cbor_encode(c, out, sizeof(out));
+		assert(n == rv && memcmp(out, buf, n) == 0);
+		cbor_free(&cbor_default_allocator, c);
+	}
+
+	/* deeper than the decoder's built-in stack */
+	memset(buf, 0x81, 100);
+	buf[100] = 0x00;
+	assert(cbor_scan(&cbor_default_allocator, buf, 101, &si) == 0 && si.depth == 100);
+	c = cbor_decode_flat(&cbor_default_allocator, buf, 101);
+	assert(c != nil && cbor_encode_size(c) == 101);
+	cbor_free(&cbor_default_allocator, c);
+
+	/* the elements of a flat map are not its own to reallocate */
+	rv = dec16(buf, sizeof(buf), "a1616101", 8);
+	c = cbor_decode_flat(&cbor_default_allocator, buf, rv);
+	assert(c != nil && cbor_map_index(&cbor_default_allocator, c) < 0);
+	cbor_free(&cbor_default_allocator, c);
+
+	/* malformed input is caught by the scan */
+	rv = dec16(buf, sizeof(buf), "9f5f41016101ffff", 16);
+	assert(cbor_scan(&cbor_default_allocator, buf, rv, &si) < 0);
+	assert(cbor_decode_flat(&cbor_default_allocator, buf, rv) == nil);
+}
+
+/* expand every lazy node under c */
+static void
+expand_all(cbor *c)
+{
+	int i;
+
+	switch(c->type){
+	case CBOR_ARRAY:
+	case CBOR_MAP:
+		if(cbor_expand(&cbor_default_allocator, c) < 0)
+			sysfatal("cbor_expand: %r");
+		assert((c->flags & CBOR_FLAG_LAZY) == 0);
+		for(i = 0; i < c->len; i++)
+			expand_all(c->array[i]);
+		break;
+
+	case CBOR_MAP_ELEMENT:
+		expand_all(c->key);
+		expand_all(c->value);
+		break;
+
+	case CBOR_TAG:
+		expand_all(c->item);
+		break;
+	}
+}
+
+static void
+test_lazy(void)
+{
+	int i, rv;
+	ulong n;
+	char *p;
+	s64int v;
+	uchar buf[512], out[512], *deep;
+	cbor *c, *e;
+
+	for(i = 0; i < nelem(tests); i++){
+		p = tests[i];
+		if(strncmp(p, "0x", 2) == 0)
+			p += 2;
+		rv = dec16(buf, sizeof(buf), p, strlen(p));
+		assert(rv != -1);
+
+		c = cbor_decode_lazy(&cbor_default_allocator, buf, rv);
+		if(c == nil)
+			sysfatal("test %d: cbor_decode_lazy: %r", i);
+
+		/* unread containers are copied through */
+		n = cbor_encode(c, out, sizeof(out));
+		assert(n == rv && memcmp(out, buf, n) == 0);
+
+		expand_all(c);
+		n = cbor_encode(c, out, sizeof(out));
+		assert(n == rv && memcmp(out, buf, n) == 0);
+		cbor_free(&cbor_default_allocator, c);
+	}
+
+	/* {"a": 1, "b": [h'01020304', "IETF"]} */
+	rv = dec16(buf, sizeof(buf), "a261610161628244010203046449455446", 34);
+	c = cbor_decode_lazy(&cbor_default_allocator, buf, rv);
+	assert(c != nil && c->type == CBOR_MAP && (c->flags & CBOR_FLAG_LAZY) != 0);
+
+	e = cbor_index(&cbor_default_allocator, c, 1);
+	assert(e != nil && e->type == CBOR_MAP_ELEMENT);
+	assert(e->value->type == CBOR_ARRAY && (e->value->flags & CBOR_FLAG_LAZY) != 0);
+
+	e = cbor_index(&cbor_default_allocator, e->value, 1);
+	assert(e != nil && e->type == CBOR_STRING && e->len == 4);
+	assert(e->string == (char*)buf + rv - 4);
+	assert(cbor_index(&cbor_default_allocator, c, 2) == nil);
+	cbor_free(&cbor_default_allocator, c);
+
+	/* cbor_unpack expands what it reads */
+	c = cbor_decode_lazy(&cbor_default_allocator, buf, rv);
+	assert(c != nil);
+	assert(cbor_unpack(&cbor_default_allocator, c, "{Si}", "a", &v) == 0 && v == 1);
+	cbor_free(&cbor_default_allocator, c);
+
+	/* errors in unread parts are found when they are reached */
+	rv = dec16(buf, sizeof(buf), "8281ff01", 8);
+	c = cbor_decode_lazy(&cbor_default_allocator, buf, rv);
+	assert(c != nil);
+	assert(cbor_expand(&cbor_default_allocator, c) < 0);
+	assert((c->flags & CBOR_FLAG_LAZY) != 0);
+	cbor_free(&cbor_default_allocator, c);
+
+	/* tags nest no deeper than when decoding eagerly */
+	deep = malloc(CBOR_MAXDEPTH + 2);
+	assert(deep != nil);
+	memset(deep, 0xc1, CBOR_MAXDEPTH + 1);
+	deep[CBOR_MAXDEPTH + 1] = 0x00;
+	assert(cbor_decode_lazy(&cbor_default_allocator, deep, CBOR_MAXDEPTH + 2) == nil);
+	assert(cbor_decode(&cbor_default_allocator, deep, CBOR_MAXDEPTH + 2) == nil);
+	c = cbor_decode_lazy(&cbor_default_allocator, deep+1, CBOR_MAXDEPTH + 1);
+	assert(c != nil);
+	cbor_free(&cbor_default_allocator, c);
+	free(deep);
+}
+
 static void
 usage(void)
 {
@@ -393,9 +1983,34 @@ main(int argc, char *argv[])
 	fmtinstall('H', encodefmt);
 
 	test_decenc();
+	test_reference();
 	test_array();
 	test_pack();
 	test_ints();
+	test_borrow();
+	test_depth();
+	test_feed();
+	test_limits();
+	test_cursor();
+	test_skip();
+	test_query();
+	test_seq();
+	test_procs();
+	test_struct();
+	test_taghook();
+	test_intern();
+	test_mapindex();
+	test_encode_alloc();
+	test_writer();
+	test_sizecache();
+	test_canonical();
+	test_segs();
+	test_raw();
+	test_patch();
+	test_shortfloat();
+	test_indefinite();
+	test_flat();
+	test_lazy();
 
 	exits(nil);
 }
@@ -3,8 +3,6 @@
 
 #include "cbor.h"
 
-#define MIN(x, y)	((x) < (y) ? (x): (y))
-
 static int cbor_vunpack(cbor_allocator *a, cbor *c, char **fmt, va_list *va);
 
 static int
@@ -40,31 +38,36 @@ err:
 	return -1;
 }
 
-static cbor*
-map_find(cbor *map, char *key)
+/* length of a byte or text string, joining indefinite-length chunks */
+static int
+str_len(cbor *c)
 {
-	int i, klen, min;
-	cbor *e;
+	int i, n;
 
-	assert(map->type == CBOR_MAP);
+	if((c->flags & CBOR_FLAG_INDEFINITE) == 0)
+		return c->len;
 
-	klen = strlen(key);
+	n = 0;
+	for(i = 0; i < c->len; i++)
+		n += c->array[i]->len;
 
-	for(i = 0; i < map->len; i++){
-		e = map->array[i];
-		assert(e->type == CBOR_MAP_ELEMENT);
-		if(e->key->type != CBOR_STRING)
-			continue;
-
-		min = MIN(klen, e->key->len);
+	return n;
+}
 
-		if(strncmp(e->key->string, key, min) != 0)
-			continue;
+static void
+str_copy(uchar *p, cbor *c)
+{
+	int i;
 
-		return e->value;
+	if((c->flags & CBOR_FLAG_INDEFINITE) == 0){
+		memcpy(p, c->byte, c->len);
+		return;
 	}
 
-	return nil;
+	for(i = 0; i < c->len; i++){
+		memcpy(p, c->array[i]->byte, c->array[i]->len);
+		p += c->array[i]->len;
+	}
 }
 
 static int
@@ -87,7 +90,9 @@ cbor_vunpack_map(cbor_allocator *a, cbor *map, char **fmt, va_list *va)
 		case 'S':
 			key = va_arg(*va, char*);
 
-			v = map_find(map, key);
+			v = cbor_map_get(map, key, strlen(key));
+			if(v == nil)
+				goto err;
 			break;
 		}
 
@@ -105,6 +110,7 @@ cbor_vunpack(cbor_allocator *a, cbor *c, char **fmt, va_list *va)
 	u64int *up;
 	s64int *sp;
 	int *lenp;
+	int n;
 	uchar *uch, **uchp;
 	char *sch, **schp;
 	cbor **cp;
@@ -137,13 +143,14 @@ cbor_vunpack(cbor_allocator *a, cbor *c, char **fmt, va_list *va)
 		lenp = va_arg(*va, int*);
 		uchp = va_arg(*va, uchar**);
 
-		uch = a->alloc(a->context, c->len);
+		n = str_len(c);
+		uch = a->alloc(a->context, n);
 		if(uch == nil)
 			break;
 
-		memcpy(uch, c->byte, c->len);
+		str_copy(uch, c);
 
-		*lenp = c->len;
+		*lenp = n;
 		*uchp = uch;
 		return 0;
 
@@ -154,15 +161,16 @@ cbor_vunpack(cbor_allocator *a, cbor *c, char **fmt, va_list *va)
 		lenp = va_arg(*va, int*);
 		schp = va_arg(*va, char**);
 
-		sch = a->alloc(a->context, c->len+1);
+		n = str_len(c);
+		sch = a->alloc(a->context, n+1);
 		if(sch == nil)
 			break;
 
-		memcpy(sch, c->string, c->len);
+		str_copy((uchar*)sch, c);
 
-		sch[c->len] = '\0';
+		sch[n] = '\0';
 
-		*lenp = c->len;
+		*lenp = n;
 		*schp = sch;
 		return 0;
 
@@ -170,12 +178,18 @@ cbor_vunpack(cbor_allocator *a, cbor *c, char **fmt, va_list *va)
 		if(c->type != CBOR_MAP)
 			break;
 
+		if(cbor_expand(a, c) < 0)
+			break;
+
 		return cbor_vunpack_map(a, c, fmt, va);
 
 	case '[':
 		if(c->type != CBOR_ARRAY)
 			break;
 
+		if(cbor_expand(a, c) < 0)
+			break;
+
 		return cbor_vunpack_array(a, c, fmt, va);
 
 	case 't':
@@ -0,0 +1,415 @@
+#include <u.h>
+#include <libc.h>
+
+#include "cbor.h"
+#include "cborimpl.h"
+
+/*
+ * a cbor_writer puts items straight into a buffer, with no tree
+ * and no allocation. an array, map or tag is begun with its
+ * header and followed by its contents; indefinite-length ones
+ * are closed with cbor_end. when the buffer fills it is passed
+ * to flush, if there is one, and refilled; it must hold at least
+ * 9 bytes, the longest header. without a flush, what does not fit
+ * is still counted in n, so a failed write says how much room it
+ * needed.
+ *
+ * errors stick: after the first, puts only count and return -1,
+ * so a run of them can be checked once at the end.
+ */
+
+void
+cbor_writer_init(cbor_writer *w, uchar *buf, ulong n, long (*flush)(void*, uchar*, long), void *arg)
+{
+	w->s = buf;
+	w->p = buf;
+	w->e = buf + n;
+	w->flush = flush;
+	w->arg = arg;
+	w->n = 0;
+	w->err = 0;
+}
+
+static long
+fdflush(void *arg, uchar *buf, long n)
+{
+	return write((int)(uintptr)arg, buf, n);
+}
+
+/* a writer that flushes buf[0:n] to fd */
+void
+cbor_writer_fd(cbor_writer *w, int fd, uchar *buf, ulong n)
+{
+	cbor_writer_init(w, buf, n, fdflush, (void*)(uintptr)fd);
+}
+
+/* pass what is buffered to flush */
+int
+cbor_writer_flush(cbor_writer *w)
+{
+	long n;
+
+	if(w->err)
+		return -1;
+
+	n = w->p - w->s;
+	if(n == 0 || w->flush == nil)
+		return 0;
+
+	if(w->flush(w->arg, w->s, n) != n){
+		w->err = 1;
+		return -1;
+	}
+
+	w->p = w->s;
+
+	return 0;
+}
+
+static void
+wfull(cbor_writer *w)
+{
+	if(!w->err){
+		werrstr("cbor_writer: buffer full");
+		w->err = 1;
+	}
+}
+
+/* room for a header of n bytes */
+static uchar*
+wtake(cbor_writer *w, int n)
+{
+	uchar *p;
+
+	w->n += n;
+	if(w->err)
+		return nil;
+
+	if(w->e - w->p < n){
+		if(w->flush == nil || cbor_writer_flush(w) < 0 || w->e - w->p < n){
+			wfull(w);
+			return nil;
+		}
+	}
+
+	p = w->p;
+	w->p += n;
+
+	return p;
+}
+
+static void
+whead(cbor_writer *w, uchar major, u64int v)
+{
+	uchar *p;
+
+	p = wtake(w, cbor_headlen(v));
+	if(p != nil)
+		cbor_puthead(p, major, v);
+}
+
+static void
+wop(cbor_writer *w, uchar op)
+{
+	uchar *p;
+
+	p = wtake(w, 1);
+	if(p != nil)
+		*p = op;
+}
+
+/* string contents; what does not fit the buffer goes to flush directly */
+static void
+wbytes(cbor_writer *w, uchar *s, ulong n)
+{
+	ulong m;
+
+	w->n += n;
+	if(w->err)
+		return;
+
+	m = w->e - w->p;
+	if(n > m && w->flush != nil){
+		if(cbor_writer_flush(w) < 0)
+			return;
+
+		if(n > w->e - w->p){
+			if(w->flush(w->arg, s, n) != n)
+				w->err = 1;
+			return;
+		}
+	} else if(n > m){
+		wfull(w);
+		return;
+	}
+
+	memmove(w->p, s, n);
+	w->p += n;
+}
+
+static int
+wdone(cbor_writer *w)
+{
+	return w->err ? -1 : 0;
+}
+
+int
+cbor_put_uint(cbor_writer *w, u64int v)
+{
+	whead(w, 0<<5, v);
+	return wdone(w);
+}
+
+int
+cbor_put_int(cbor_writer *w, s64int v)
+{
+	if(v >= 0)
+		whead(w, 0<<5, v);
+	else
+		whead(w, 1<<5, -1 - v);
+	return wdone(w);
+}
+
+int
+cbor_put_byte(cbor_writer *w, uchar *buf, ulong n)
+{
+	whead(w, 2<<5, n);
+	wbytes(w, buf, n);
+	return wdone(w);
+}
+
+int
+cbor_put_string(cbor_writer *w, char *s, ulong n)
+{
+	whead(w, 3<<5, n);
+	wbytes(w, (uchar*)s, n);
+	return wdone(w);
+}
+
+int
+cbor_put_null(cbor_writer *w)
+{
+	wop(w, 0xf6);
+	return wdone(w);
+}
+
+int
+cbor_put_float(cbor_writer *w, float f)
+{
+	u32int v;
+	uchar *p;
+
+	memcpy(&v, &f, 4);
+
+	p = wtake(w, 5);
+	if(p != nil){
+		*p++ = 0xfa;
+		*p++ = v >> 24;
+		*p++ = v >> 16;
+		*p++ = v >> 8;
+		*p = v;
+	}
+
+	return wdone(w);
+}
+
+static void
+putdouble(uchar *p, double d)
+{
+	u64int v;
+
+	memcpy(&v, &d, 8);
+
+	*p++ = 0xfb;
+	*p++ = v >> 56;
+	*p++ = v >> 48;
+	*p++ = v >> 40;
+	*p++ = v >> 32;
+	*p++ = v >> 24;
+	*p++ = v >> 16;
+	*p++ = v >> 8;
+	*p = v;
+}
+
+int
+cbor_put_double(cbor_writer *w, double d)
+{
+	uchar *p;
+
+	p = wtake(w, 9);
+	if(p != nil)
+		putdouble(p, d);
+
+	return wdone(w);
+}
+
+/* d as the shortest of half, single and double precision that holds it */
+int
+cbor_put_real(cbor_writer *w, double d)
+{
+	uchar *p;
+
+	p = wtake(w, cbor_floatlen(d));
+	if(p != nil)
+		cbor_putfloat(p, d);
+
+	return wdone(w);
+}
+
+/* the tagged item is put next */
+int
+cbor_put_tag(cbor_writer *w, u64int tag)
+{
+	whead(w, 6<<5, tag);
+	return wdone(w);
+}
+
+/* n elements follow; if n < 0, as many as come before cbor_end */
+int
+cbor_begin_array(cbor_writer *w, vlong n)
+{
+	if(n < 0)
+		wop(w, 4<<5 | 31);
+	else
+		whead(w, 4<<5, n);
+	return wdone(w);
+}
+
+/* n keys and values follow; if n < 0, as many as come before cbor_end */
+int
+cbor_begin_map(cbor_writer *w, vlong n)
+{
+	if(n < 0)
+		wop(w, 5<<5 | 31);
+	else
+		whead(w, 5<<5, n);
+	return wdone(w);
+}
+
+/* close an indefinite-length array or map */
+int
+cbor_end(cbor_writer *w)
+{
+	wop(w, 0xff);
+	return wdone(w);
+}
+
+/*
+ * fixed-width fields: these put a number in its 9 byte form
+ * whatever its value, and return its offset in the output, so
+ * that it can be overwritten in place later by cbor_patch_*
+ * without moving anything after it. the offset counts from the
+ * start of everything put, so a writer whose buffer is flushed
+ * before the patch must keep what it flushed to patch there.
+ */
+
+static vlong
+wfixed(cbor_writer *w, uchar major, u64int v)
+{
+	vlong off;
+	uchar *p;
+
+	off = w->n;
+	p = wtake(w, 9);
+	if(p == nil)
+		return -1;
+
+	cbor_putheadn(p, major, v, 9);
+
+	return off;
+}
+
+vlong
+cbor_put_uint_fixed(cbor_writer *w, u64int v)
+{
+	return wfixed(w, 0<<5, v);
+}
+
+vlong
+cbor_put_int_fixed(cbor_writer *w, s64int v)
+{
+	if(v >= 0)
+		return wfixed(w, 0<<5, v);
+	return wfixed(w, 1<<5, -1 - v);
+}
+
+vlong
+cbor_put_double_fixed(cbor_writer *w, double d)
+{
+	vlong off;
+	uchar *p;
+
+	off = w->n;
+	p = wtake(w, 9);
+	if(p == nil)
+		return -1;
+
+	putdouble(p, d);
+
+	return off;
+}
+
+/* the field at off in buf[0:n], if it is a 9 byte form starting with op0 or op1 */
+static uchar*
+patchfield(uchar *buf, ulong n, vlong off, uchar op0, uchar op1)
+{
+	uchar *p;
+
+	if(off < 0 || off > n || n - off < 9){
+		werrstr("field out of range");
+		return nil;
+	}
+
+	p = buf + off;
+	if(*p != op0 && *p != op1){
+		werrstr("not a fixed-width field");
+		return nil;
+	}
+
+	return p;
+}
+
+int
+cbor_patch_uint(uchar *buf, ulong n, vlong off, u64int v)
+{
+	uchar *p;
+
+	p = patchfield(buf, n, off, 0x1b, 0x3b);
+	if(p == nil)
+		return -1;
+
+	cbor_putheadn(p, 0<<5, v, 9);
+
+	return 0;
+}
+
+int
+cbor_patch_int(uchar *buf, ulong n, vlong off, s64int v)
+{
+	uchar *p;
+
+	p = patchfield(buf, n, off, 0x1b, 0x3b);
+	if(p == nil)
+		return -1;
+
+	if(v >= 0)
+		cbor_putheadn(p, 0<<5, v, 9);
+	else
+		cbor_putheadn(p, 1<<5, -1 - v, 9);
+
+	return 0;
+}
+
+int
+cbor_patch_double(uchar *buf, ulong n, vlong off, double d)
+{
+	uchar *p;
+
+	p = patchfield(buf, n, off, 0xfb, 0xfb);
+	if(p == nil)
+		return -1;
+
+	putdouble(p, d);
+
+	return 0;
+}